@@ -1,8 +1,10 @@
 // © 2016 PORT INC.
 
+#include <algorithm>
 #include <cstdlib>
 #include <fstream>
 #include <regex>
+#include <sstream>
 #include <boost/lexical_cast.hpp>
 #include <boost/numeric/ublas/vector.hpp>
 #include <boost/numeric/ublas/io.hpp>
@@ -120,6 +122,65 @@ namespace App {
 
 	///////////////
 
+	const int SpanFeatureCache_::SHARD_SIZE = 16;
+
+	SpanFeatureCache_::SpanFeatureCache_(int arg)
+		: capacity(std::max(1, arg/SHARD_SIZE))
+		, shards(SHARD_SIZE)
+	{
+		Logger::trace() << "SpanFeatureCache_()";
+	}
+
+	SpanFeatureCache_::~SpanFeatureCache_()
+	{
+		Logger::trace() << "~SpanFeatureCache_()";
+	}
+
+	bool SpanFeatureCache_::find(const std::string& key, SpanFeature& sf)
+	{
+		auto& shard = shards[std::hash<std::string>()(key) % SHARD_SIZE];
+		std::lock_guard<std::mutex> lock(shard.mtx);
+
+		auto it = shard.map.find(key);
+		if( it == shard.map.end() ) {
+			++miss;
+			return false;
+		}
+
+		sf = it->second;
+		++hit;
+		return true;
+	}
+
+	void SpanFeatureCache_::insert(const std::string& key, const SpanFeature& sf)
+	{
+		auto& shard = shards[std::hash<std::string>()(key) % SHARD_SIZE];
+		std::lock_guard<std::mutex> lock(shard.mtx);
+
+		// 上限に達したらシャードごと捨てる
+		if( capacity <= shard.map.size() ) {
+			eviction += shard.map.size();
+			shard.map.clear();
+		}
+		shard.map.insert(std::make_pair(key, sf));
+	}
+
+	void SpanFeatureCache_::reportStatistcs()
+	{
+		long long h = hit;
+		long long m = miss;
+		size_t entries = 0;
+		for( auto& shard : shards ) {
+			std::lock_guard<std::mutex> lock(shard.mtx);
+			entries += shard.map.size();
+		}
+
+		double rate = ( 0 < h+m ) ? (double)h/(double)(h+m) : 0.0;
+		Logger::out()->info( "span feature cache: hit rate: {} ({}/{}), entries: {}, evicted: {}", rate, h, h+m, entries, (long long)eviction );
+	}
+
+	///////////////
+
 	decltype( std::make_shared<FeatureFunction>() )
 	createFeatureFunction(const std::string& feature, const std::string& w2vmat, const std::string& areaDic, const std::string& jobDic)
 	{
@@ -133,12 +194,11 @@ namespace App {
 			
 			auto jpnff = std::make_shared<Jpn>();
 
-			// auto m = std::make_shared<W2V::Matrix_>();
-			// if( w2vmat.empty() ) {
-			// 	throw Error("no w2v matrix file specifed");
-			// }
-			// m->read(w2vmat);
-			// jpnff->setMatrix(m);
+			if( !w2vmat.empty() ) {
+				auto m = std::make_shared<W2V::Matrix_>();
+				m->read(w2vmat);
+				jpnff->setMatrix(m);
+			}
 
 			if( !areaDic.empty() ) {
 				auto dic = std::make_shared<Dictonary_>();
@@ -197,13 +257,17 @@ namespace App {
 		Data& x,
 		int j,
 		int i,
-		uvector& gs )
+		FeatureVector& gs )
 	{
 		assert(0 < xDim);
 		assert(0 < yDim);
 
 		double v = 0.0;
 
+		if( x.getHistgramDim() != xDim + 1 ) {
+			throw Error("Digit::wg: word id histgram not prepared");
+		}
+
 		try {
 
 			int yval = static_cast<int>(y);
@@ -213,23 +277,13 @@ namespace App {
 			int dim1 = yDim * ( xDim + yDim );
 			int dim2 = yDim * ( xDim + yDim + 1 );
 
-			uvector fvec(dim2, 0.0);
-
-			// y2x
 			int d = i - j + 1;
-			for( int l = 0; l < d; l++ ) {
-
-				const auto& str = x.getStrs()->at(j+l).at(0);
-				int xval = boost::lexical_cast<int>(str);
-				fvec(yval*xDim+xval) += 1.0;
-			}
+			const int* h0 = x.getHistgram(j);
+			const int* h1 = x.getHistgram(i+1);
 
-            // y2y
-			fvec(dim0+ydval*yDim+yval) = 1.0;
-
-            // y2l
-			auto m = x.getMean(static_cast<int>(y));
-			auto s = x.getVariance(static_cast<int>(y));
+			// y2l
+			auto m = x.getMean(yval);
+			auto s = x.getVariance(yval);
 			const double eps = 1.0e-5;
 			double f = 0.0;
 			if( eps < s ) {
@@ -239,12 +293,67 @@ namespace App {
 				f = 1.0;
 			}
 
-			fvec(dim1+yval) = f;
+			gs.clear();
+
+			if( h1[xDim] == h0[xDim] ) {
+
+				// y2x
+				int k = yval*xDim;
+				for( int xval = 0; xval < xDim; xval++, k++ ) {
+					double c = h1[xval] - h0[xval];
+					if( c != 0.0 ) {
+						gs.emplace_back(k, c);
+						v += ws[k]*c;
+					}
+				}
 
-			int k = 0;
-			for( const auto& w : ws ) {
-				gs(k) = fvec(k);
-				v += w*fvec(k++);
+				// y2y
+				k = dim0+ydval*yDim+yval;
+				gs.emplace_back(k, 1.0);
+				v += ws[k];
+
+				// y2l
+				k = dim1+yval;
+				gs.emplace_back(k, f);
+				v += ws[k]*f;
+
+			} else {
+
+				// xDim 以上の単語IDを含むセグメントでは他の素性と重なり得るので、従来通り素性ベクトルを作る
+				// その単語IDはヒストグラムに無いので、セグメントを走査して数える
+				uvector fvec(dim2, 0.0);
+
+				// y2x
+				for( int xval = 0; xval < xDim; xval++ ) {
+					int c = h1[xval] - h0[xval];
+					if( c ) {
+						fvec(yval*xDim+xval) += c;
+					}
+				}
+				for( int l = j; l <= i; l++ ) {
+					int xval = boost::lexical_cast<int>(x.getStrs()->at(l).at(0));
+					if( xDim <= xval ) {
+						int k = yval*xDim+xval;
+						if( dim2 <= k ) {
+							throw Error("Digit::wg: word id out of range");
+						}
+						fvec(k) += 1.0;
+					}
+				}
+
+				// y2y
+				fvec(dim0+ydval*yDim+yval) = 1.0;
+
+				// y2l
+				fvec(dim1+yval) = f;
+
+				int k = 0;
+				for( const auto& w : ws ) {
+					if( fvec(k) != 0.0 ) {
+						gs.emplace_back(k, fvec(k));
+					}
+					v += w*fvec(k++);
+				}
 			}
 
 		} catch (...) {
@@ -271,14 +380,19 @@ namespace App {
 
 	int Jpn::getDim()
 	{
-		return (FEATURE_DIM + yDim)*yDim;
+		return (FEATURE_DIM + yDim + getEmbeddingDim() + hashedDim)*yDim;
+	}
+
+	int Jpn::getEmbeddingDim()
+	{
+		return w2vmat.get() ? w2vmat->getSize() : 0;
 	}
 
 	void Jpn::setXDim(int arg)
 	{
-		// if( w2vmat->getSize() != arg ) {
-		// 	throw Error("dimension mismatch");
-		// }
+		if( w2vmat.get() && w2vmat->getSize() != arg ) {
+			throw Error("dimension mismatch");
+		}
 		xDim = arg;
 	}
 
@@ -735,6 +849,253 @@ namespace App {
 		return f;
 	}
 
+	void Jpn::setSpanCacheSize(int size)
+	{
+		if( 0 < size ) {
+			spancache = std::make_shared<SpanFeatureCache_>(size);
+		} else {
+			spancache = nullptr;
+		}
+	}
+
+	void Jpn::setHashedFeature(const std::string& templates, int dim)
+	{
+		if( dim < 0 ) {
+			throw Error("negative hashed feature dimension specified");
+		}
+
+		hashedDim = dim;
+		hashedTemplates = 0;
+		if( hashedDim == 0 ) {
+			return;
+		}
+
+		std::string ts = templates.empty() ? "word,boundary,ngram,dic" : templates;
+		typedef boost::char_separator<char> char_separator;
+		typedef boost::tokenizer<char_separator> tokenizer;
+		char_separator sep(",");
+		tokenizer tokens(ts, sep);
+		for( const auto& t : tokens ) {
+			if( t == "word" ) {
+				hashedTemplates |= HASHED_WORD;
+			} else if( t == "boundary" ) {
+				hashedTemplates |= HASHED_BOUNDARY;
+			} else if( t == "ngram" ) {
+				hashedTemplates |= HASHED_NGRAM;
+			} else if( t == "dic" ) {
+				hashedTemplates |= HASHED_DIC;
+			} else {
+				std::stringstream ss;
+				ss << "unknown hashed feature template specified: " << t;
+				throw Error(ss.str());
+			}
+		}
+
+		Logger::out()->info( "hashed feature: templates: {}, dimension: {}", ts, hashedDim );
+	}
+
+	void Jpn::candidateSpans(Data& x, int minLength, int maxLength, std::vector<char>& mask)
+	{
+		// 長いスパンは、辞書に載る語や数字・金額の記号などの手掛かりを含むか、
+		// 括弧で囲まれているか、直前に項目を示す語があるときだけ候補にする
+		const auto& xs = *x.getStrs();
+		int s = xs.size();
+
+		std::vector<int> clue(s+1, 0); // 手掛かりとなる語の累積数
+		std::vector<char> open(s, 0);
+		std::vector<char> close(s, 0);
+		std::vector<char> indicator(s, 0);
+		std::vector<std::string> word(1);
+
+		for( int k = 0; k < s; k++ ) {
+			const auto& w = xs[k].back(); // 学習、推論で words のカラムが違うが、どちらにしろ最後に入っている
+			word[0] = w;
+
+			int flg = 0;
+			bool c = ( areadic.get() && areadic->exist(w) )
+				|| ( jobdic.get() && jobdic->exist(w, flg) )
+				|| 0.0 < number_feature(word)
+				|| 0.0 < post_salaly_feature(word)
+				|| 0.0 < employment_structure_feature(word);
+			clue[k+1] = clue[k] + (c ? 1 : 0);
+
+			open[k] = 0.0 < front_bracket_feature(word);
+			close[k] = 0.0 < back_bracket_feature(word);
+			indicator[k] = 0.0 < place_indicator_feature(word)
+				|| 0.0 < job_indicator_feature(word)
+				|| 0.0 < employment_structure_indicator_feature(word);
+		}
+
+		mask.assign(s*maxLength, 1);
+		for( int i = 0; i < s; i++ ) {
+			for( int d = minLength; d <= std::min(maxLength, i+1); d++ ) {
+				int j = i-d+1;
+				bool c = clue[j] < clue[i+1]
+					|| ( 0 < j && i+1 < s && open[j-1] && close[i+1] )
+					|| ( 0 < j && indicator[j-1] )
+					|| ( 1 < j && indicator[j-2] );
+				mask[i*maxLength+d-1] = c;
+			}
+		}
+	}
+
+	void Jpn::reportStatistcs()
+	{
+		if( spancache.get() ) {
+			spancache->reportStatistcs();
+		}
+	}
+
+	static uint64_t hash(const std::string& tag, const std::string& s0, const std::string& s1 = "")
+	{
+		// FNV-1a、テンプレート名と単語の間は区切り文字を挟む
+		uint64_t h = 14695981039346656037ULL;
+		auto feed = [&h](const std::string& s) {
+			for( auto c : s ) {
+				h ^= static_cast<unsigned char>(c);
+				h *= 1099511628211ULL;
+			}
+			h ^= 0x1f;
+			h *= 1099511628211ULL;
+		};
+		feed(tag);
+		feed(s0);
+		feed(s1);
+		return h;
+	}
+
+	void Jpn::hashedFeature (
+		const std::vector<std::string>& words,
+		const std::vector<std::string>& pre_words,
+		const std::vector<std::string>& post_words,
+		std::vector<int>& hs )
+	{
+		hs.clear();
+
+		// 最上位ビットを符号に使い、衝突による偏りを打ち消す
+		auto push = [this, &hs](uint64_t h) {
+			int b = static_cast<int>((h & 0x7fffffffffffffffULL) % hashedDim);
+			hs.push_back( (h >> 63) ? -(b+1) : b );
+		};
+
+		if( hashedTemplates & HASHED_WORD ) {
+			for( const auto& w : words ) {
+				push(hash("w", w));
+			}
+		}
+
+		if( hashedTemplates & HASHED_BOUNDARY ) {
+			push(hash("b0", words.front()));
+			push(hash("b1", words.back()));
+			push(hash("p", pre_words.empty() ? "<s>" : pre_words.back()));
+			push(hash("n", post_words.empty() ? "</s>" : post_words.front()));
+		}
+
+		if( hashedTemplates & HASHED_NGRAM ) {
+			const std::string& pre = pre_words.empty() ? "<s>" : pre_words.back();
+			const std::string& post = post_words.empty() ? "</s>" : post_words.front();
+			push(hash("g", pre, words.front()));
+			for( int i = 0; i+1 < words.size(); i++ ) {
+				push(hash("g", words[i], words[i+1]));
+			}
+			push(hash("g", words.back(), post));
+		}
+
+		if( hashedTemplates & HASHED_DIC ) {
+			for( const auto& w : words ) {
+				if( areadic.get() && areadic->exist(w) ) {
+					push(hash("d", "area"));
+				}
+				int flg = 0;
+				if( jobdic.get() && jobdic->exist(w, flg) ) {
+					push(hash("d", "job", std::to_string(flg)));
+				}
+			}
+		}
+	}
+
+	void Jpn::spanFeature (
+		const std::vector<std::string>& words,
+		const std::vector<std::string>& pre_words,
+		const std::vector<std::string>& post_words,
+		SpanFeature& sf )
+	{
+		auto& fs = sf.fs;
+		fs.assign(FEATURE_DIM + getEmbeddingDim(), 0.0);
+		int fd = 0;
+
+		// 勤務地の素性
+		fs[fd++] = place_feature(words);
+		fs[fd++] = place_indicator_feature(pre_words);
+		fs[fd++] = place_indicator_feature(words);
+		fs[fd++] = back_place_indicator_feature(post_words);
+		fs[fd++] = number_feature(post_words); // 番地が続く
+
+		// 職種の素性
+		fs[fd++] = job_feature_0(words);
+		fs[fd++] = job_feature_1(words);
+		fs[fd++] = job_feature_2(words);
+		fs[fd++] = back_job_feature(post_words);
+		fs[fd++] = job_indicator_feature(pre_words);
+		fs[fd++] = job_indicator_feature(words);
+
+		// 雇用形態の素性
+		fs[fd++] = employment_structure_indicator_feature(pre_words);
+		fs[fd++] = employment_structure_feature(words);
+
+		// 給与の素性
+		fs[fd++] = pre_salaly_feature(words);
+		fs[fd++] = post_salaly_feature(words);
+		fs[fd++] = number_feature(words);
+		// fs[fd++] = hyphen_feature(words);
+		// fs[fd++] = yen_feature(words);
+
+		// 括弧
+		fs[fd++] = front_bracket_feature(pre_words);
+		fs[fd++] = back_bracket_feature(post_words);
+
+		// デリミタ
+		fs[fd++] = front_delimiter_feature(pre_words);
+		fs[fd++] = back_delimiter_feature(post_words);
+
+		// 単語ベクトルの平均
+		if( w2vmat.get() ) {
+			long long e = w2vmat->getSize();
+			double* acc = fs.data() + FEATURE_DIM;
+			int n = 0;
+			for( const auto& w : words ) {
+				auto idx = w2vmat->w2i(w);
+				if( idx < 0 ) {
+					continue;
+				}
+				w2vmat->add(idx, acc);
+				n++;
+			}
+			if( 1 < n ) {
+				for( long long k = 0; k < e; k++ ) {
+					acc[k] /= n;
+				}
+			}
+		}
+
+		// ハッシュ素性
+		if( 0 < hashedDim ) {
+			hashedFeature(words, pre_words, post_words, sf.hs);
+		} else {
+			sf.hs.clear();
+		}
+#if 0
+		for( const auto& s : words ) {
+			std::cout << s;
+		}
+		std::cout << " ";
+		for( int i = 0; i < FEATURE_DIM; i++ ) {
+			std::cout << fs[i] << " ";
+		}
+		std::cout << std::endl;
+#endif
+	}
+
 	double Jpn::wg (
 		Weights& ws,
 		Label y,
@@ -742,7 +1103,7 @@ namespace App {
 		Data& x,
 		int j,
 		int i,
-		uvector& gs )
+		FeatureVector& gs )
 	{
 		assert(0 < yDim);
 
@@ -753,10 +1114,11 @@ namespace App {
 		int yval = static_cast<int>(y);
 		int ydval = static_cast<int>(yd);
 		int d = i - j + 1;
-		uvector fvec(getDim(), 0.0);
 		std::vector<std::string> words;
 		std::vector<std::string> pre_words;
 		std::vector<std::string> post_words;
+		SpanFeature sf;
+		const auto& fs = sf.fs;
 
 		try {
 
@@ -781,65 +1143,76 @@ namespace App {
 				}
 			}
 
-			int fd = yval*FEATURE_DIM;
-
-			// 勤務地の素性
-			fvec(fd++) = place_feature(words);
-			fvec(fd++) = place_indicator_feature(pre_words);
-			fvec(fd++) = place_indicator_feature(words);
-			fvec(fd++) = back_place_indicator_feature(post_words);
-			fvec(fd++) = number_feature(post_words); // 番地が続く
-
-			// 職種の素性
-			fvec(fd++) = job_feature_0(words);
-			fvec(fd++) = job_feature_1(words);
-			fvec(fd++) = job_feature_2(words);
-			fvec(fd++) = back_job_feature(post_words);
-			fvec(fd++) = job_indicator_feature(pre_words);
-			fvec(fd++) = job_indicator_feature(words);
-
-			// 雇用形態の素性
-			fvec(fd++) = employment_structure_indicator_feature(pre_words);
-			fvec(fd++) = employment_structure_feature(words);
-
-			// 給与の素性
-			fvec(fd++) = pre_salaly_feature(words);
-			fvec(fd++) = post_salaly_feature(words);
-			fvec(fd++) = number_feature(words);
-			// fvec(fd++) = hyphen_feature(words);
-			// fvec(fd++) = yen_feature(words);
-
-			// 括弧
-			fvec(fd++) = front_bracket_feature(pre_words);
-			fvec(fd++) = back_bracket_feature(post_words);
-
-			// デリミタ
-			fvec(fd++) = front_delimiter_feature(pre_words);
-			fvec(fd++) = back_delimiter_feature(post_words);
-#if 0
-			for( const auto& s : words ) {
-				std::cout << s;
-			}
-			std::cout << " ";
-			for( int i = yval*FEATURE_DIM; i < yval*FEATURE_DIM+FEATURE_DIM; i++ ) {
-				std::cout << fvec(i) << " ";
+			// スパン素性は y に依らず窓内の単語列だけで決まるのでキャッシュできる
+			if( spancache.get() ) {
+
+				std::string key;
+				for( const auto& s : pre_words ) { key += s; key += '\x1f'; }
+				key += '\x1e';
+				for( const auto& s : words ) { key += s; key += '\x1f'; }
+				key += '\x1e';
+				for( const auto& s : post_words ) { key += s; key += '\x1f'; }
+
+				if( !spancache->find(key, sf) ) {
+					spanFeature(words, pre_words, post_words, sf);
+					spancache->insert(key, sf);
+				}
+
+			} else {
+
+				spanFeature(words, pre_words, post_words, sf);
 			}
-			std::cout << std::endl;
-#endif
+
 		} catch (...) {
 			throw Error("Jpn::wg: y2x: unexpected exception");
 		}
 
-		// y2y
-		fvec(yDim*FEATURE_DIM+ydval*yDim+yval) = 1.0;
-
 		// innner product
+		// 非零の素性は y のブロック、y2y、単語ベクトルとハッシュ素性のブロックだけなので、添字の順に足し合わせる
 		try {
 
-			int k = 0;
-			for( const auto& w : ws ) {
-				gs(k) = fvec(k);
-				v += w*fvec(k++);
+			int e = getEmbeddingDim();
+			gs.clear();
+			gs.reserve(FEATURE_DIM + 1 + e + sf.hs.size());
+
+			// y2x
+			int k = yval*FEATURE_DIM;
+			for( int l = 0; l < FEATURE_DIM; l++, k++ ) {
+				if( fs[l] != 0.0 ) {
+					gs.emplace_back(k, fs[l]);
+					v += ws[k]*fs[l];
+				}
+			}
+
+			// y2y
+			k = yDim*FEATURE_DIM+ydval*yDim+yval;
+			gs.emplace_back(k, 1.0);
+			v += ws[k];
+
+			// 単語ベクトル
+			if( 0 < e ) {
+				k = yDim*(FEATURE_DIM+yDim)+yval*e;
+				const double* f = fs.data() + FEATURE_DIM;
+				for( int l = 0; l < e; l++ ) {
+					gs.emplace_back(k+l, f[l]);
+				}
+				v += W2V::dot(ws.data()+k, f, e);
+			}
+
+			// ハッシュ素性、衝突した添字は重複したまま並べる
+			if( 0 < hashedDim ) {
+				int base = yDim*(FEATURE_DIM+yDim+e)+yval*hashedDim;
+				for( auto h : sf.hs ) {
+					if( h < 0 ) {
+						k = base-h-1;
+						gs.emplace_back(k, -1.0);
+						v -= ws[k];
+					} else {
+						k = base+h;
+						gs.emplace_back(k, 1.0);
+						v += ws[k];
+					}
+				}
 			}
 
 		} catch (...) {
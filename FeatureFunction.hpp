@@ -3,21 +3,33 @@
 #ifndef APP_TEST__H
 #define APP_TEST__H
 
+#include <atomic>
+#include <mutex>
 #include <set>
 #include <string>
 #include <set>
+#include <unordered_map>
 #include "SemiCrf.hpp"
 #include "W2V.hpp"
 
 namespace App {
 
 	using uvector = SemiCrf::uvector;
+	using FeatureVector = SemiCrf::FeatureVector;
 	using Weights = SemiCrf::Weights;
 	using Data = SemiCrf::Data;
 	using FeatureFunction = SemiCrf::FeatureFunction;
 
 	const int ZERO = 0;
 
+	// ハッシュ素性のテンプレート
+	enum {
+		HASHED_WORD       =  0x1        // スパン内の単語
+		, HASHED_BOUNDARY = (0x1 << 1)  // スパンの両端と前後の単語
+		, HASHED_NGRAM    = (0x1 << 2)  // 前後の単語を含む単語 bigram
+		, HASHED_DIC      = (0x1 << 3)  // 辞書のクラス
+	};
+
 	decltype( std::make_shared<FeatureFunction>() )
 	createFeatureFunction(const std::string& feature, const std::string& w2vmat, const std::string& areaDic, const std::string& jobDic);
 
@@ -44,6 +56,37 @@ namespace App {
 	typedef std::shared_ptr<Dictonary_> Dictonary;
 	typedef std::shared_ptr<JobDictonary_> JobDictonary;
 
+	// スパン素性
+	// y に依らない部分で、固定の素性と単語ベクトルの平均、ハッシュ素性のバケットからなる
+	struct SpanFeature {
+		std::vector<double> fs;
+		std::vector<int> hs; // バケット番号、符号が負のものは -(番号+1)
+	};
+
+	// スパン素性のキャッシュ
+	// 前後の窓を含む単語列をキーとし、文やページをまたいで共有する
+	class SpanFeatureCache_ {
+	public:
+		SpanFeatureCache_(int capacity);
+		virtual ~SpanFeatureCache_();
+		bool find(const std::string& key, SpanFeature& sf);
+		void insert(const std::string& key, const SpanFeature& sf);
+		void reportStatistcs();
+	private:
+		static const int SHARD_SIZE;
+		struct Shard {
+			std::mutex mtx;
+			std::unordered_map<std::string, SpanFeature> map;
+		};
+		int capacity; // シャードあたりの最大エントリ数
+		std::vector<Shard> shards;
+		std::atomic<long long> hit{0};
+		std::atomic<long long> miss{0};
+		std::atomic<long long> eviction{0};
+	};
+
+	typedef std::shared_ptr<SpanFeatureCache_> SpanFeatureCache;
+
 	class Digit : public FeatureFunction {
 	public:
 		Digit();
@@ -51,7 +94,7 @@ namespace App {
 		virtual int getDim();
 		virtual void read();
 		virtual void write();
-		virtual double wg(Weights& ws, Label y, Label yd, Data& x, int j, int i, uvector& gs);
+		virtual double wg(Weights& ws, Label y, Label yd, Data& x, int j, int i, FeatureVector& gs);
 	};
 
 	class Jpn : public FeatureFunction {
@@ -62,11 +105,26 @@ namespace App {
 		virtual void setXDim(int arg);
 		virtual void read();
 		virtual void write();
-		virtual double wg(Weights& ws, Label y, Label yd, Data& x, int j, int i, uvector& gs);
+		virtual double wg(Weights& ws, Label y, Label yd, Data& x, int j, int i, FeatureVector& gs);
 		void setMatrix(W2V::Matrix m) { w2vmat = m; }
 		void setAreaDic(Dictonary dic) { areadic = dic; }
 		void setJobDic(JobDictonary dic) { jobdic = dic; }
+		virtual void setSpanCacheSize(int size);
+		virtual void setHashedFeature(const std::string& templates, int dim);
+		virtual void reportStatistcs();
+		virtual void candidateSpans(Data& x, int minLength, int maxLength, std::vector<char>& mask);
 	private:
+		int getEmbeddingDim();
+		void spanFeature (
+			const std::vector<std::string>& words,
+			const std::vector<std::string>& pre_words,
+			const std::vector<std::string>& post_words,
+			SpanFeature& sf );
+		void hashedFeature (
+			const std::vector<std::string>& words,
+			const std::vector<std::string>& pre_words,
+			const std::vector<std::string>& post_words,
+			std::vector<int>& hs );
 		double front_delimiter_feature(const std::vector<std::string>& words);
 		double back_delimiter_feature(const std::vector<std::string>& words);
 		double front_bracket_feature(const std::vector<std::string>& words);
@@ -91,6 +149,9 @@ namespace App {
 		W2V::Matrix w2vmat;
 		Dictonary areadic;
 		JobDictonary jobdic;
+		SpanFeatureCache spancache;
+		int hashedDim{0}; // ラベルあたりのハッシュ素性の次元
+		int hashedTemplates{0}; // HASHED_* の論理和
 		std::set<std::string> unknown_words;
 		const static int FEATURE_DIM;
 		static std::vector<std::string> open_brakets;
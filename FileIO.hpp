@@ -3,6 +3,8 @@
 #ifndef FILE_IO__H
 #define FILE_IO__H
 
+#include <cstdio>
+#include <fstream>
 #include <sstream>
 #include "Error.hpp"
 
@@ -16,4 +18,19 @@ void open(T& strm, const std::string& arg) {
 	}
 }
 
+// 一時ファイルに書き終えてから置き換える、書いている途中で止まっても前のファイルが残る
+template <class F>
+void writeAtomically(const std::string& arg, F write) {
+	std::string tmp = arg + ".tmp";
+	std::ofstream ofs;
+	open(ofs, tmp);
+	write(ofs);
+	ofs.close();
+	if( ofs.fail() || std::rename(tmp.c_str(), arg.c_str()) != 0 ) {
+		std::stringstream ss;
+		ss << "cannot write such file: " << arg;
+		throw Error(ss.str());
+	}
+}
+
 #endif // FILE_IO__H
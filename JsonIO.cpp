@@ -13,6 +13,13 @@ namespace JsonIO {
 		return std::move(ujson::parse(jsonstr));
 	}
 
+	// find は lower_bound なので、無いキーでも次のキーを返す
+	bool has(Object& object, const std::string& tag)
+	{
+		auto it = find(object, tag.c_str());
+		return it != object.end() && it->first == tag;
+	}
+
 	std::string readString(Object& object, const std::string& tag)
 	{
 		auto it = find(object, tag.c_str());
@@ -159,6 +166,35 @@ namespace JsonIO {
 		return std::move(iim);
 	}
 
+	std::set<std::pair<int, int>> readIntIntPairs(Object& object, const std::string& tag)
+	{
+		std::set<std::pair<int,int>> iip;
+
+		auto it = find(object, tag.c_str());
+		if( it == object.end() || !it->second.is_array() ) {
+			std::stringstream ss;
+			ss << "'" << tag << "' with type array not found";
+			throw Error(ss.str());
+		}
+
+		auto array0 = array_cast(std::move(it->second));
+		for( auto i = array0.begin(); i != array0.end(); ++i ) {
+
+			if( !i->is_array() ) {
+				throw Error("invalid data format");
+			}
+
+			auto array1 = array_cast(std::move(*i));
+			if( array1.size() != 2 || !array1[0].is_number() || !array1[1].is_number() ) {
+				throw Error("invalid data format");
+			}
+
+			iip.insert(std::make_pair(int32_cast(std::move(array1[0])), int32_cast(std::move(array1[1]))));
+		}
+
+		return std::move(iip);
+	}
+
 	std::vector<ujson::value> readUAry(Object& object, const std::string& tag)
 	{
 		auto it = find(object, tag.c_str());
@@ -6,18 +6,22 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
 #include "ujson.hpp"
 
 namespace JsonIO {
 
 	using Object = std::vector<std::pair<std::string, ujson::value>>;
 	ujson::value parse(std::istream& is);
+	bool has(Object& object, const std::string& tag);
 	std::string readString(Object& object, const std::string& tag);
 	int readInt(Object& object, const std::string& tag);
 	std::vector<int> readIntAry(Object& object, const std::string& tag);
 	std::vector<double> readDoubleAry(Object& object, const std::string& tag);
 	std::map<int, double> readIntDoubleMap(Object& object, const std::string& tag);
 	std::map<int, int> readIntIntMap(Object& object, const std::string& tag);
+	std::set<std::pair<int, int>> readIntIntPairs(Object& object, const std::string& tag);
 	std::vector<ujson::value> readUAry(Object& object, const std::string& tag);
 }
 
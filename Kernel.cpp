@@ -0,0 +1,712 @@
+// © 2016 PORT INC.
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNEL_X86
+#endif
+#include "Kernel.hpp"
+#include "Error.hpp"
+
+namespace Kernel {
+
+	// スカラー実装は libm の exp を呼び、ベクトル実装は exp もベクトルで求める
+	// ベクトルの exp は x = k*ln2 + r (|r| <= ln2/2) と分け、exp(r) を 13 次の Taylor 展開で求めて 2^k を掛ける
+	// 打ち切り誤差は 1e-17 程度なので、libm との違いは丸めの数 ulp と足し合わせの順序だけになる
+
+	//// half ////
+
+	// F16C を使わない実装 (スカラー実装と端数) で使う
+
+	float halfToFloat(uint16_t h)
+	{
+		uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+		int32_t e = (h >> 10) & 0x1f;
+		uint32_t m = h & 0x3ff;
+		uint32_t x;
+
+		if( e == 0 ) {
+			if( m == 0 ) {
+				x = sign;
+			} else { // 非正規化数
+				e = 1;
+				while( !(m & 0x400) ) {
+					m <<= 1;
+					e--;
+				}
+				m &= 0x3ff;
+				x = sign | ((e + 112) << 23) | (m << 13);
+			}
+		} else if( e == 31 ) {
+			x = sign | 0x7f800000 | (m << 13);
+		} else {
+			x = sign | ((e + 112) << 23) | (m << 13);
+		}
+
+		float f;
+		std::memcpy(&f, &x, sizeof(f));
+		return f;
+	}
+
+	//// scalar ////
+
+	static double sumExpScalar(const double* a, const double* w, int n)
+	{
+		double s = 0.0;
+		for( int k = 0; k < n; k++ ) {
+			s += a[k]*std::exp(w[k]);
+		}
+		return s;
+	}
+
+	static double maxAddScalar(const double* v, const double* w, int n, double& m)
+	{
+		m = -std::numeric_limits<double>::infinity();
+		for( int k = 0; k < n; k++ ) {
+			double t = v[k] + w[k];
+			if( m < t ) {
+				m = t;
+			}
+		}
+		return m;
+	}
+
+	static void addF32Scalar(const float* v, double* acc, long long n)
+	{
+		for( long long i = 0; i < n; i++ ) {
+			float f;
+			std::memcpy(&f, v + i, sizeof(float)); // マップしたファイル上では境界が揃っていない
+			acc[i] += f;
+		}
+	}
+
+	static double dotF64Scalar(const double* a, const double* b, long long n)
+	{
+		double s = 0.0;
+		for( long long i = 0; i < n; i++ ) {
+			s += a[i]*b[i];
+		}
+		return s;
+	}
+
+	static double dotF32Scalar(const float* v, const double* b, long long n)
+	{
+		double s = 0.0;
+		for( long long i = 0; i < n; i++ ) {
+			float f;
+			std::memcpy(&f, v + i, sizeof(float));
+			s += f*b[i];
+		}
+		return s;
+	}
+
+	static void addI8Scalar(const int8_t* v, float scale, double* acc, long long n)
+	{
+		for( long long i = 0; i < n; i++ ) {
+			acc[i] += static_cast<double>(scale)*v[i];
+		}
+	}
+
+	static void addF16Scalar(const uint16_t* v, float scale, double* acc, long long n)
+	{
+		for( long long i = 0; i < n; i++ ) {
+			acc[i] += static_cast<double>(scale)*halfToFloat(v[i]);
+		}
+	}
+
+	static double dotI8Scalar(const int8_t* v, float scale, const double* b, long long n)
+	{
+		double s = 0.0;
+		for( long long i = 0; i < n; i++ ) {
+			s += v[i]*b[i];
+		}
+		return s*scale;
+	}
+
+	static double dotF16Scalar(const uint16_t* v, float scale, const double* b, long long n)
+	{
+		double s = 0.0;
+		for( long long i = 0; i < n; i++ ) {
+			s += halfToFloat(v[i])*b[i];
+		}
+		return s*scale;
+	}
+
+#if defined(KERNEL_X86)
+
+	// exp の範囲の制限と分割、Taylor 展開の係数 1/j! (j = 13..2)
+	static const double expHi = 710.0; // これより大きければ inf
+	static const double expLo = -746.0; // これより小さければ 0
+	static const double log2e = 1.4426950408889634;
+	static const double ln2Hi = 6.93147180369123816490e-01;
+	static const double ln2Lo = 1.90821492927058770002e-10;
+	static const double expCoef[] = {
+		1.0/6227020800.0, 1.0/479001600.0, 1.0/39916800.0, 1.0/3628800.0, 1.0/362880.0, 1.0/40320.0,
+		1.0/5040.0, 1.0/720.0, 1.0/120.0, 1.0/24.0, 1.0/6.0, 1.0/2.0
+	};
+
+	//// avx2 ////
+
+	// 2^k は指数部を直接組み立てる、k は範囲外の値を避けるため半分ずつに分けて掛ける
+	// min、max は NaN の時に第 2 引数を返すので、NaN はそのまま伝わる
+	__attribute__((target("avx2,fma")))
+	static inline __m256d expAvx2(__m256d x)
+	{
+		x = _mm256_max_pd(_mm256_set1_pd(expLo), _mm256_min_pd(_mm256_set1_pd(expHi), x));
+		__m256d k = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		__m256d r = _mm256_fnmadd_pd(k, _mm256_set1_pd(ln2Hi), x);
+		r = _mm256_fnmadd_pd(k, _mm256_set1_pd(ln2Lo), r);
+
+		__m256d p = _mm256_set1_pd(expCoef[0]);
+		for( int j = 1; j < 12; j++ ) {
+			p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(expCoef[j]));
+		}
+		p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+		p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(1.0));
+
+		// 2^52+2^51 を足すと仮数部の下位に整数が入るので、それを指数部へ移す
+		const __m256d magic = _mm256_set1_pd(6755399441055744.0);
+		__m256d k1 = _mm256_floor_pd(_mm256_mul_pd(k, _mm256_set1_pd(0.5)));
+		__m256d k2 = _mm256_sub_pd(k, k1);
+		__m256i e1 = _mm256_slli_epi64(_mm256_castpd_si256(_mm256_add_pd(_mm256_add_pd(k1, _mm256_set1_pd(1023.0)), magic)), 52);
+		__m256i e2 = _mm256_slli_epi64(_mm256_castpd_si256(_mm256_add_pd(_mm256_add_pd(k2, _mm256_set1_pd(1023.0)), magic)), 52);
+		return _mm256_mul_pd(_mm256_mul_pd(p, _mm256_castsi256_pd(e1)), _mm256_castsi256_pd(e2));
+	}
+
+	__attribute__((target("avx2,fma")))
+	static double sumExpAvx2(const double* a, const double* w, int n)
+	{
+		int k = 0;
+		__m256d s0 = _mm256_setzero_pd();
+		for( ; k + 4 <= n; k += 4 ) {
+			__m256d e = expAvx2(_mm256_loadu_pd(w + k));
+			s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + k), e, s0);
+		}
+		// 端数はマスクして読み、読まない要素は a=0 なので和に寄与しない
+		if( k < n ) {
+			__m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n - k), _mm256_set_epi64x(3, 2, 1, 0));
+			__m256d e = expAvx2(_mm256_maskload_pd(w + k, mask));
+			s0 = _mm256_fmadd_pd(_mm256_maskload_pd(a + k, mask), e, s0);
+		}
+		double t[4];
+		_mm256_storeu_pd(t, s0);
+		return (t[0] + t[1]) + (t[2] + t[3]);
+	}
+
+	__attribute__((target("avx2")))
+	static double maxAddAvx2(const double* v, const double* w, int n, double& m)
+	{
+		int k = 0;
+		__m256d m0 = _mm256_set1_pd(-std::numeric_limits<double>::infinity());
+		for( ; k + 4 <= n; k += 4 ) {
+			m0 = _mm256_max_pd(m0, _mm256_add_pd(_mm256_loadu_pd(v + k), _mm256_loadu_pd(w + k)));
+		}
+		double t[4];
+		_mm256_storeu_pd(t, m0);
+		m = std::max(std::max(t[0], t[1]), std::max(t[2], t[3]));
+		for( ; k < n; k++ ) {
+			double x = v[k] + w[k];
+			if( m < x ) {
+				m = x;
+			}
+		}
+		return m;
+	}
+
+	// 単語ベクトルは端数をスカラー実装に任せる
+	__attribute__((target("avx2,fma")))
+	static void addF32Avx2(const float* v, double* acc, long long n)
+	{
+		long long i = 0;
+		for( ; i + 4 <= n; i += 4 ) {
+			__m256d x = _mm256_cvtps_pd(_mm_loadu_ps(v + i));
+			_mm256_storeu_pd(acc + i, _mm256_add_pd(_mm256_loadu_pd(acc + i), x));
+		}
+		addF32Scalar(v + i, acc + i, n - i);
+	}
+
+	__attribute__((target("avx2,fma")))
+	static double dotF64Avx2(const double* a, const double* b, long long n)
+	{
+		long long i = 0;
+		__m256d s0 = _mm256_setzero_pd();
+		__m256d s1 = _mm256_setzero_pd();
+		for( ; i + 8 <= n; i += 8 ) {
+			s0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), s0);
+			s1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), s1);
+		}
+		double t[4];
+		_mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+		return (t[0] + t[1]) + (t[2] + t[3]) + dotF64Scalar(a + i, b + i, n - i);
+	}
+
+	__attribute__((target("avx2,fma")))
+	static double dotF32Avx2(const float* v, const double* b, long long n)
+	{
+		long long i = 0;
+		__m256d s0 = _mm256_setzero_pd();
+		__m256d s1 = _mm256_setzero_pd();
+		for( ; i + 8 <= n; i += 8 ) {
+			__m256 f = _mm256_loadu_ps(v + i);
+			s0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(f)), _mm256_loadu_pd(b + i), s0);
+			s1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)), _mm256_loadu_pd(b + i + 4), s1);
+		}
+		double t[4];
+		_mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+		return (t[0] + t[1]) + (t[2] + t[3]) + dotF32Scalar(v + i, b + i, n - i);
+	}
+
+	// 量子化した行は 8 要素ずつ double に広げる、半精度の変換には F16C を使う
+	__attribute__((target("avx2,fma")))
+	static void addI8Avx2(const int8_t* v, float scale, double* acc, long long n)
+	{
+		long long i = 0;
+		__m256d s = _mm256_set1_pd(scale);
+		for( ; i + 8 <= n; i += 8 ) {
+			__m256i x = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(v + i)));
+			_mm256_storeu_pd(acc + i, _mm256_fmadd_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(x)), s, _mm256_loadu_pd(acc + i)));
+			_mm256_storeu_pd(acc + i + 4, _mm256_fmadd_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1)), s, _mm256_loadu_pd(acc + i + 4)));
+		}
+		addI8Scalar(v + i, scale, acc + i, n - i);
+	}
+
+	__attribute__((target("avx2,fma,f16c")))
+	static void addF16Avx2(const uint16_t* v, float scale, double* acc, long long n)
+	{
+		long long i = 0;
+		__m256d s = _mm256_set1_pd(scale);
+		for( ; i + 8 <= n; i += 8 ) {
+			__m256 f = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i)));
+			_mm256_storeu_pd(acc + i, _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(f)), s, _mm256_loadu_pd(acc + i)));
+			_mm256_storeu_pd(acc + i + 4, _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)), s, _mm256_loadu_pd(acc + i + 4)));
+		}
+		addF16Scalar(v + i, scale, acc + i, n - i);
+	}
+
+	__attribute__((target("avx2,fma")))
+	static double dotI8Avx2(const int8_t* v, float scale, const double* b, long long n)
+	{
+		long long i = 0;
+		__m256d s0 = _mm256_setzero_pd();
+		__m256d s1 = _mm256_setzero_pd();
+		for( ; i + 8 <= n; i += 8 ) {
+			__m256i x = _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(v + i)));
+			s0 = _mm256_fmadd_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(x)), _mm256_loadu_pd(b + i), s0);
+			s1 = _mm256_fmadd_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1)), _mm256_loadu_pd(b + i + 4), s1);
+		}
+		double t[4];
+		_mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+		return ((t[0] + t[1]) + (t[2] + t[3]))*scale + dotI8Scalar(v + i, scale, b + i, n - i);
+	}
+
+	__attribute__((target("avx2,fma,f16c")))
+	static double dotF16Avx2(const uint16_t* v, float scale, const double* b, long long n)
+	{
+		long long i = 0;
+		__m256d s0 = _mm256_setzero_pd();
+		__m256d s1 = _mm256_setzero_pd();
+		for( ; i + 8 <= n; i += 8 ) {
+			__m256 f = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i)));
+			s0 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(f)), _mm256_loadu_pd(b + i), s0);
+			s1 = _mm256_fmadd_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)), _mm256_loadu_pd(b + i + 4), s1);
+		}
+		double t[4];
+		_mm256_storeu_pd(t, _mm256_add_pd(s0, s1));
+		return ((t[0] + t[1]) + (t[2] + t[3]))*scale + dotF16Scalar(v + i, scale, b + i, n - i);
+	}
+
+	//// avx512 ////
+
+	// 2^k は scalef で掛ける、桁あふれと下位桁あふれも scalef が扱う
+	__attribute__((target("avx512f")))
+	static inline __m512d expAvx512(__m512d x)
+	{
+		x = _mm512_max_pd(_mm512_set1_pd(expLo), _mm512_min_pd(_mm512_set1_pd(expHi), x));
+		__m512d k = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+		__m512d r = _mm512_fnmadd_pd(k, _mm512_set1_pd(ln2Hi), x);
+		r = _mm512_fnmadd_pd(k, _mm512_set1_pd(ln2Lo), r);
+
+		__m512d p = _mm512_set1_pd(expCoef[0]);
+		for( int j = 1; j < 12; j++ ) {
+			p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(expCoef[j]));
+		}
+		p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+		p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(1.0));
+
+		return _mm512_scalef_pd(p, k);
+	}
+
+	__attribute__((target("avx512f")))
+	static double sumExpAvx512(const double* a, const double* w, int n)
+	{
+		int k = 0;
+		__m512d s0 = _mm512_setzero_pd();
+		for( ; k + 8 <= n; k += 8 ) {
+			__m512d e = expAvx512(_mm512_loadu_pd(w + k));
+			s0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + k), e, s0);
+		}
+		// 端数はマスクして読み、読まない要素は a=0 なので和に寄与しない
+		if( k < n ) {
+			__mmask8 mask = static_cast<__mmask8>((1u << (n - k)) - 1);
+			__m512d e = expAvx512(_mm512_maskz_loadu_pd(mask, w + k));
+			s0 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, a + k), e, s0);
+		}
+		double t[8];
+		_mm512_storeu_pd(t, s0);
+		return ((t[0] + t[1]) + (t[2] + t[3])) + ((t[4] + t[5]) + (t[6] + t[7]));
+	}
+
+	__attribute__((target("avx512f")))
+	static double maxAddAvx512(const double* v, const double* w, int n, double& m)
+	{
+		int k = 0;
+		__m512d m0 = _mm512_set1_pd(-std::numeric_limits<double>::infinity());
+		for( ; k + 8 <= n; k += 8 ) {
+			m0 = _mm512_max_pd(m0, _mm512_add_pd(_mm512_loadu_pd(v + k), _mm512_loadu_pd(w + k)));
+		}
+		double t[8];
+		_mm512_storeu_pd(t, m0);
+		m = -std::numeric_limits<double>::infinity();
+		for( int l = 0; l < 8; l++ ) {
+			m = std::max(m, t[l]);
+		}
+		for( ; k < n; k++ ) {
+			double x = v[k] + w[k];
+			if( m < x ) {
+				m = x;
+			}
+		}
+		return m;
+	}
+
+	__attribute__((target("avx512f")))
+	static void addF32Avx512(const float* v, double* acc, long long n)
+	{
+		long long i = 0;
+		for( ; i + 8 <= n; i += 8 ) {
+			__m512d x = _mm512_cvtps_pd(_mm256_loadu_ps(v + i));
+			_mm512_storeu_pd(acc + i, _mm512_add_pd(_mm512_loadu_pd(acc + i), x));
+		}
+		addF32Scalar(v + i, acc + i, n - i);
+	}
+
+	__attribute__((target("avx512f")))
+	static double dotF64Avx512(const double* a, const double* b, long long n)
+	{
+		long long i = 0;
+		__m512d s0 = _mm512_setzero_pd();
+		__m512d s1 = _mm512_setzero_pd();
+		for( ; i + 16 <= n; i += 16 ) {
+			s0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), s0);
+			s1 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8), _mm512_loadu_pd(b + i + 8), s1);
+		}
+		double t[8];
+		_mm512_storeu_pd(t, _mm512_add_pd(s0, s1));
+		return ((t[0] + t[1]) + (t[2] + t[3])) + ((t[4] + t[5]) + (t[6] + t[7])) + dotF64Scalar(a + i, b + i, n - i);
+	}
+
+	__attribute__((target("avx512f")))
+	static double dotF32Avx512(const float* v, const double* b, long long n)
+	{
+		long long i = 0;
+		__m512d s0 = _mm512_setzero_pd();
+		for( ; i + 8 <= n; i += 8 ) {
+			s0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm256_loadu_ps(v + i)), _mm512_loadu_pd(b + i), s0);
+		}
+		double t[8];
+		_mm512_storeu_pd(t, s0);
+		return ((t[0] + t[1]) + (t[2] + t[3])) + ((t[4] + t[5]) + (t[6] + t[7])) + dotF32Scalar(v + i, b + i, n - i);
+	}
+
+	// 量子化した行は 16 要素ずつ広げ、下位と上位の 8 要素に分けて double にする
+	__attribute__((target("avx512f")))
+	static void addI8Avx512(const int8_t* v, float scale, double* acc, long long n)
+	{
+		long long i = 0;
+		__m512d s = _mm512_set1_pd(scale);
+		for( ; i + 16 <= n; i += 16 ) {
+			__m512i x = _mm512_cvtepi8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i)));
+			_mm512_storeu_pd(acc + i, _mm512_fmadd_pd(_mm512_cvtepi32_pd(_mm512_castsi512_si256(x)), s, _mm512_loadu_pd(acc + i)));
+			_mm512_storeu_pd(acc + i + 8, _mm512_fmadd_pd(_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(x, 1)), s, _mm512_loadu_pd(acc + i + 8)));
+		}
+		addI8Scalar(v + i, scale, acc + i, n - i);
+	}
+
+	__attribute__((target("avx512f")))
+	static void addF16Avx512(const uint16_t* v, float scale, double* acc, long long n)
+	{
+		long long i = 0;
+		__m512d s = _mm512_set1_pd(scale);
+		for( ; i + 16 <= n; i += 16 ) {
+			__m512 f = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i)));
+			__m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(f), 1));
+			_mm512_storeu_pd(acc + i, _mm512_fmadd_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(f)), s, _mm512_loadu_pd(acc + i)));
+			_mm512_storeu_pd(acc + i + 8, _mm512_fmadd_pd(_mm512_cvtps_pd(hi), s, _mm512_loadu_pd(acc + i + 8)));
+		}
+		addF16Scalar(v + i, scale, acc + i, n - i);
+	}
+
+	__attribute__((target("avx512f")))
+	static double dotI8Avx512(const int8_t* v, float scale, const double* b, long long n)
+	{
+		long long i = 0;
+		__m512d s0 = _mm512_setzero_pd();
+		__m512d s1 = _mm512_setzero_pd();
+		for( ; i + 16 <= n; i += 16 ) {
+			__m512i x = _mm512_cvtepi8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(v + i)));
+			s0 = _mm512_fmadd_pd(_mm512_cvtepi32_pd(_mm512_castsi512_si256(x)), _mm512_loadu_pd(b + i), s0);
+			s1 = _mm512_fmadd_pd(_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(x, 1)), _mm512_loadu_pd(b + i + 8), s1);
+		}
+		double t[8];
+		_mm512_storeu_pd(t, _mm512_add_pd(s0, s1));
+		return (((t[0] + t[1]) + (t[2] + t[3])) + ((t[4] + t[5]) + (t[6] + t[7])))*scale + dotI8Scalar(v + i, scale, b + i, n - i);
+	}
+
+	__attribute__((target("avx512f")))
+	static double dotF16Avx512(const uint16_t* v, float scale, const double* b, long long n)
+	{
+		long long i = 0;
+		__m512d s0 = _mm512_setzero_pd();
+		__m512d s1 = _mm512_setzero_pd();
+		for( ; i + 16 <= n; i += 16 ) {
+			__m512 f = _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(v + i)));
+			__m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(f), 1));
+			s0 = _mm512_fmadd_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(f)), _mm512_loadu_pd(b + i), s0);
+			s1 = _mm512_fmadd_pd(_mm512_cvtps_pd(hi), _mm512_loadu_pd(b + i + 8), s1);
+		}
+		double t[8];
+		_mm512_storeu_pd(t, _mm512_add_pd(s0, s1));
+		return (((t[0] + t[1]) + (t[2] + t[3])) + ((t[4] + t[5]) + (t[6] + t[7])))*scale + dotF16Scalar(v + i, scale, b + i, n - i);
+	}
+
+#endif
+
+	//// dispatch ////
+
+	struct Impl {
+		const char* isa;
+		double (*sumExp)(const double*, const double*, int);
+		double (*maxAdd)(const double*, const double*, int, double&);
+		void (*addF32)(const float*, double*, long long);
+		double (*dotF64)(const double*, const double*, long long);
+		double (*dotF32)(const float*, const double*, long long);
+		void (*addI8)(const int8_t*, float, double*, long long);
+		void (*addF16)(const uint16_t*, float, double*, long long);
+		double (*dotI8)(const int8_t*, float, const double*, long long);
+		double (*dotF16)(const uint16_t*, float, const double*, long long);
+	};
+
+	static const Impl scalar {
+		"scalar", sumExpScalar, maxAddScalar,
+		addF32Scalar, dotF64Scalar, dotF32Scalar, addI8Scalar, addF16Scalar, dotI8Scalar, dotF16Scalar
+	};
+#if defined(KERNEL_X86)
+	static const Impl avx2 {
+		"avx2", sumExpAvx2, maxAddAvx2,
+		addF32Avx2, dotF64Avx2, dotF32Avx2, addI8Avx2, addF16Avx2, dotI8Avx2, dotF16Avx2
+	};
+	static const Impl avx512 {
+		"avx512", sumExpAvx512, maxAddAvx512,
+		addF32Avx512, dotF64Avx512, dotF32Avx512, addI8Avx512, addF16Avx512, dotI8Avx512, dotF16Avx512
+	};
+#endif
+
+	static std::vector<const Impl*> supported()
+	{
+		std::vector<const Impl*> impls;
+#if defined(KERNEL_X86)
+		__builtin_cpu_init();
+		if( __builtin_cpu_supports("avx512f") ) {
+			impls.push_back(&avx512);
+		}
+		if( __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c") ) {
+			impls.push_back(&avx2);
+		}
+#endif
+		impls.push_back(&scalar);
+		return impls;
+	}
+
+	// 起動時に一度だけ、使える中で最も幅の広い実装を選ぶ
+	static const Impl* current = supported().front();
+
+	double sumExp(const double* a, const double* w, int n)
+	{
+		return current->sumExp(a, w, n);
+	}
+
+	double maxAdd(const double* v, const double* w, int n, int& k)
+	{
+		double m;
+		current->maxAdd(v, w, n, m);
+
+		// 最大値と等しくなる最初の要素を探す、和は同じ演算なので値は一致する
+		k = -1;
+		for( int l = 0; l < n; l++ ) {
+			if( v[l] + w[l] == m ) {
+				k = l;
+				break;
+			}
+		}
+		return m;
+	}
+
+	void addF32(const float* v, double* acc, long long n)
+	{
+		current->addF32(v, acc, n);
+	}
+
+	double dotF64(const double* a, const double* b, long long n)
+	{
+		return current->dotF64(a, b, n);
+	}
+
+	double dotF32(const float* v, const double* b, long long n)
+	{
+		return current->dotF32(v, b, n);
+	}
+
+	void addI8(const int8_t* v, float scale, double* acc, long long n)
+	{
+		current->addI8(v, scale, acc, n);
+	}
+
+	void addF16(const uint16_t* v, float scale, double* acc, long long n)
+	{
+		current->addF16(v, scale, acc, n);
+	}
+
+	double dotI8(const int8_t* v, float scale, const double* b, long long n)
+	{
+		return current->dotI8(v, scale, b, n);
+	}
+
+	double dotF16(const uint16_t* v, float scale, const double* b, long long n)
+	{
+		return current->dotF16(v, scale, b, n);
+	}
+
+	const char* getIsa()
+	{
+		return current->isa;
+	}
+
+	void select(const std::string& isa)
+	{
+		for( auto impl : supported() ) {
+			if( isa == impl->isa ) {
+				current = impl;
+				return;
+			}
+		}
+
+		std::stringstream ss;
+		ss << "unsupported kernel isa specified: " << isa;
+		throw Error(ss.str());
+	}
+
+	std::vector<std::string> supportedIsas()
+	{
+		std::vector<std::string> isas;
+		for( auto impl : supported() ) {
+			isas.push_back(impl->isa);
+		}
+		return isas;
+	}
+
+	//// fixed ////
+
+	// 配列は L*M 個まで詰め物がしてあるものとし、ループの回数を定数にして展開させる
+	// 詰め物の exp(-inf) は 0 なので和は変わらない
+	template <int L, int M>
+	static double sumExpFixed(const double* a, const double* w, int)
+	{
+		constexpr int N = L*M;
+		double e[N];
+		for( int k = 0; k < N; k++ ) {
+			e[k] = std::exp(w[k]);
+		}
+		double s[4] = { 0.0, 0.0, 0.0, 0.0 };
+		for( int k = 0; k < N; k++ ) {
+			s[k%4] += a[k]*e[k];
+		}
+		return (s[0] + s[1]) + (s[2] + s[3]);
+	}
+
+	// 最大値は定数回のループで求め、最大となる最初の要素は詰め物の手前までで探す
+	template <int L, int M>
+	static double maxAddFixed(const double* v, const double* w, int n, int& k)
+	{
+		constexpr int N = L*M;
+		double x[N];
+		for( int l = 0; l < N; l++ ) {
+			x[l] = v[l] + w[l];
+		}
+		double m[4];
+		for( int l = 0; l < 4; l++ ) {
+			m[l] = -std::numeric_limits<double>::infinity();
+		}
+		for( int l = 0; l < N; l++ ) {
+			m[l%4] = std::max(m[l%4], x[l]);
+		}
+		double mx = std::max(std::max(m[0], m[1]), std::max(m[2], m[3]));
+
+		k = -1;
+		for( int l = 0; l < n; l++ ) {
+			if( x[l] == mx ) {
+				k = l;
+				break;
+			}
+		}
+		return mx;
+	}
+
+	// L を固定し、M = 1..M0 を実体化する
+	template <int L, int M>
+	struct Fixed {
+		static void add(std::vector<Cell>& cells) {
+			Fixed<L, M-1>::add(cells);
+			cells.push_back(Cell{ L, M, sumExpFixed<L, M>, maxAddFixed<L, M> });
+		}
+	};
+
+	template <int L>
+	struct Fixed<L, 0> {
+		static void add(std::vector<Cell>&) {}
+	};
+
+	// 運用中のモデルはラベル数 7 (無しを含む)、最大長 16 まで
+	static std::vector<Cell> instantiate()
+	{
+		std::vector<Cell> cells;
+		Fixed<7, 16>::add(cells);
+		return cells;
+	}
+
+	static const Cell generic { 0, 0, sumExp, maxAdd };
+
+	const Cell& selectCell(int labels, int maxLength)
+	{
+		for( auto& cell : fixedCells() ) {
+			if( cell.labels == labels && cell.maxLength == maxLength ) {
+				return cell;
+			}
+		}
+		return generic;
+	}
+
+	const Cell& genericCell()
+	{
+		return generic;
+	}
+
+	const std::vector<Cell>& fixedCells()
+	{
+		static const std::vector<Cell> cells = instantiate();
+		return cells;
+	}
+}
@@ -0,0 +1,70 @@
+// © 2016 PORT INC.
+
+#ifndef KERNEL__H
+#define KERNEL__H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace Kernel {
+
+	// ラティスの位置毎の計算と単語ベクトル (W2V) で使うカーネル
+	// AVX-512、AVX2、スカラーの実装を実行時に CPU を見て選ぶ
+
+	// Σ a[k]*exp(w[k]) (前向き、後ろ向きの和)
+	double sumExp(const double* a, const double* w, int n);
+
+	// max v[k]+w[k] と、最大となる最初の k (Viterbi)
+	double maxAdd(const double* v, const double* w, int n, int& k);
+
+	// 単語ベクトルの足し込みと内積 (W2V)
+	// 行はマップしたファイル上にあって境界が揃っていないので、境界を問わずに読む
+
+	// acc += v
+	void addF32(const float* v, double* acc, long long n);
+
+	// a・b
+	double dotF64(const double* a, const double* b, long long n);
+	double dotF32(const float* v, const double* b, long long n);
+
+	// 量子化した行、acc += scale*v と scale*(v・b)
+	void addI8(const int8_t* v, float scale, double* acc, long long n);
+	void addF16(const uint16_t* v, float scale, double* acc, long long n);
+	double dotI8(const int8_t* v, float scale, const double* b, long long n);
+	double dotF16(const uint16_t* v, float scale, const double* b, long long n);
+
+	// 半精度浮動小数点数を単精度に
+	float halfToFloat(uint16_t h);
+
+	// 使用中の実装の名前 ("avx512", "avx2", "scalar")
+	const char* getIsa();
+
+	// 実装を名前で選ぶ、CPU が対応していなければ例外
+	void select(const std::string& isa);
+
+	// この CPU で使える実装の名前
+	std::vector<std::string> supportedIsas();
+
+	// ラベル数 L と最大長 M を固定した位置毎のカーネル
+	// 位置毎の項は高々 L*M 個なので、呼び出し側が L*M 個まで詰め物をすればループの回数が定数になる
+	// 詰め物は sumExp では a=0、maxAdd では v=-inf とし、w はどちらも -inf とする
+	struct Cell {
+		int labels; // 0 なら汎用 (実行時に選んだ ISA の sumExp、maxAdd)
+		int maxLength;
+		double (*sumExp)(const double* a, const double* w, int n);
+		double (*maxAdd)(const double* v, const double* w, int n, int& k);
+		int width() const { return labels*maxLength; }
+	};
+
+	// (L, M) に特殊化したカーネルがあればそれを、無ければ汎用のカーネルを返す
+	const Cell& selectCell(int labels, int maxLength);
+
+	// 汎用のカーネル
+	const Cell& genericCell();
+
+	// 特殊化したカーネルの一覧
+	const std::vector<Cell>& fixedCells();
+}
+
+#endif // KERNEL__H
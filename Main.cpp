@@ -10,6 +10,7 @@
 #include "Logger.hpp"
 #include "Error.hpp"
 #include "FileIO.hpp"
+#include "Kernel.hpp"
 
 class Options {
 public:
@@ -20,11 +21,36 @@ public:
 	unsigned int flg{0};
 	int logLevel{2};
 	int maxLength{0};
-	int cacheSize{0xff};
+	int spanCacheSize{0};
+	int hashedDim{0};
 	int maxIteration{1024};
 	double e0{1.0e-5};
 	double e1{1.0e-5};
 	double rp{1.0e-7};
+	double l1{0.0};
+	int epochs{10};
+	unsigned int shuffleSeed{0};
+	double paC{0.0};
+	double sgdRate{0.1};
+	int sgdBatch{10};
+	int checkpointIterations{0};
+	double checkpointSeconds{0.0};
+	bool resume{false};
+	int oldPages{-1};
+	double newDataWeight{1.0};
+	double oldDataFraction{1.0};
+	double devFraction{0.0};
+	int devPatience{2};
+	double noneFraction{1.0};
+	int cvFolds{0};
+	std::vector<std::pair<std::string,std::vector<double>>> sweep;
+	double lengthQuantile{1.0};
+	double beamThreshold{0.0};
+	int beamMinLength{0};
+	double coarseMargin{10.0};
+	int candidateMinLength{4};
+	int threads{1};
+	int parallelMinLength{512};
 	std::string method{"bfgs"};
 	std::string logPattern{""};
 	std::string weightsFile{""};
@@ -34,6 +60,9 @@ public:
 	std::string predictionDataFile{""};
 	std::string areaDicFile{""};
 	std::string jobDicFile{""};
+	std::string hashedTemplates{""};
+	std::string checkpointFile{""};
+	std::string warmStartFile{""};
 };
 
 void Options::parse(int argc, char *argv[])
@@ -50,6 +79,47 @@ void Options::parse(int argc, char *argv[])
 				std::string l(argv[++i]);
 				if( l == "auto") continue;
 				else maxLength = boost::lexical_cast<int>(l);
+			} else if( arg == "--label-length-quantile" ) {
+				lengthQuantile = boost::lexical_cast<double>(argv[++i]);
+				if( lengthQuantile <= 0.0 || 1.0 < lengthQuantile ) {
+					throw Error("label length quantile must be in (0,1]");
+				}
+			} else if( arg == "--beam-threshold" ) {
+				beamThreshold = boost::lexical_cast<double>(argv[++i]);
+				if( beamThreshold < 0.0 || 1.0 <= beamThreshold ) {
+					throw Error("beam threshold must be in [0,1)");
+				}
+			} else if( arg == "--beam-min-length" ) {
+				beamMinLength = boost::lexical_cast<int>(argv[++i]);
+			} else if( arg == "--coarse-to-fine" ) {
+				flg |= SemiCrf::ENABLE_COARSE_TO_FINE;
+			} else if( arg == "--coarse-to-fine-check" ) {
+				flg |= SemiCrf::ENABLE_COARSE_TO_FINE | SemiCrf::ENABLE_COARSE_TO_FINE_CHECK;
+			} else if( arg == "--coarse-to-fine-margin" ) {
+				coarseMargin = boost::lexical_cast<double>(argv[++i]);
+				if( coarseMargin < 0.0 ) {
+					throw Error("negative coarse-to-fine margin specified");
+				}
+			} else if( arg == "--enable-candidate-span" ) {
+				flg |= SemiCrf::ENABLE_CANDIDATE_SPAN;
+			} else if( arg == "--enable-deduplication" ) {
+				flg |= SemiCrf::ENABLE_DEDUPLICATION;
+			} else if( arg == "--candidate-span-min-length" ) {
+				candidateMinLength = boost::lexical_cast<int>(argv[++i]);
+				if( candidateMinLength < 2 ) {
+					throw Error("candidate span min length must be at least 2");
+				}
+			} else if( arg == "--threads" ) {
+				threads = boost::lexical_cast<int>(argv[++i]);
+				if( threads < 1 ) {
+					throw Error("number of threads must be positive");
+				}
+			} else if( arg == "--parallel-min-length" ) {
+				parallelMinLength = boost::lexical_cast<int>(argv[++i]);
+			} else if( arg == "--kernel-isa" ) {
+				Kernel::select(argv[++i]);
+			} else if( arg == "--enable-fixed-kernel" ) {
+				flg |= SemiCrf::ENABLE_FIXED_KERNEL;
 			} else if( arg == "-r" || arg == "--max-iteration") {
 				maxIteration = boost::lexical_cast<int>(argv[++i]);
 			} else if( arg == "-e0" ) {
@@ -58,6 +128,8 @@ void Options::parse(int argc, char *argv[])
 				e1 = boost::lexical_cast<double>(argv[++i]);
 			} else if( arg == "-g" || arg == "--regularization-parameter") {
 				rp = boost::lexical_cast<double>(argv[++i]);
+			} else if( arg == "--l1-regularization-parameter" ) {
+				l1 = boost::lexical_cast<double>(argv[++i]);
 			} else if( arg == "-w" ) {
 				weightsFile = argv[++i];
 			} else if( arg == "-w0" ) {
@@ -70,14 +142,104 @@ void Options::parse(int argc, char *argv[])
 				jobDicFile = argv[++i];
 			} else if( arg == "--set-optimizer" ) {
 				method = argv[++i];
+			} else if( arg == "--epochs" ) {
+				epochs = boost::lexical_cast<int>(argv[++i]);
+			} else if( arg == "--shuffle-seed" ) {
+				shuffleSeed = boost::lexical_cast<unsigned int>(argv[++i]);
+			} else if( arg == "--passive-aggressive" ) {
+				paC = boost::lexical_cast<double>(argv[++i]);
+			} else if( arg == "--learning-rate" ) {
+				sgdRate = boost::lexical_cast<double>(argv[++i]);
+			} else if( arg == "--checkpoint" ) {
+				checkpointFile = argv[++i];
+			} else if( arg == "--checkpoint-interval" ) {
+				checkpointIterations = boost::lexical_cast<int>(argv[++i]);
+			} else if( arg == "--checkpoint-seconds" ) {
+				checkpointSeconds = boost::lexical_cast<double>(argv[++i]);
+			} else if( arg == "--resume" ) {
+				resume = true;
+			} else if( arg == "--warm-start" ) {
+				warmStartFile = argv[++i];
+			} else if( arg == "--old-pages" ) {
+				oldPages = boost::lexical_cast<int>(argv[++i]);
+			} else if( arg == "--new-data-weight" ) {
+				newDataWeight = boost::lexical_cast<double>(argv[++i]);
+				if( newDataWeight <= 0.0 ) {
+					throw Error("new data weight must be positive");
+				}
+			} else if( arg == "--old-data-fraction" ) {
+				oldDataFraction = boost::lexical_cast<double>(argv[++i]);
+				if( oldDataFraction <= 0.0 || 1.0 < oldDataFraction ) {
+					throw Error("old data fraction must be in (0,1]");
+				}
+			} else if( arg == "--dev-fraction" ) {
+				devFraction = boost::lexical_cast<double>(argv[++i]);
+				if( devFraction < 0.0 || 1.0 <= devFraction ) {
+					throw Error("dev fraction must be in [0,1)");
+				}
+			} else if( arg == "--none-fraction" ) {
+				noneFraction = boost::lexical_cast<double>(argv[++i]);
+				if( noneFraction <= 0.0 || 1.0 < noneFraction ) {
+					throw Error("none fraction must be in (0,1]");
+				}
+			} else if( arg == "--cv" ) {
+				cvFolds = boost::lexical_cast<int>(argv[++i]);
+				if( cvFolds < 2 ) {
+					throw Error("number of folds must be at least 2");
+				}
+			} else if( arg == "--sweep" ) {
+				// rp=1e-6,1e-7 の形式、キーは rp、l1、l
+				std::string s = argv[++i];
+				auto eq = s.find('=');
+				if( eq == std::string::npos ) {
+					throw Error("invalid sweep specified");
+				}
+				auto key = s.substr(0, eq);
+				if( key != "rp" && key != "l1" && key != "l" ) {
+					throw Error("unknown sweep parameter specified");
+				}
+				std::vector<double> values;
+				std::stringstream ss(s.substr(eq+1));
+				std::string v;
+				while( std::getline(ss, v, ',') ) {
+					values.push_back(boost::lexical_cast<double>(v));
+				}
+				if( values.empty() ) {
+					throw Error("invalid sweep specified");
+				}
+				sweep.emplace_back(key, values);
+			} else if( arg == "--dev-patience" ) {
+				devPatience = boost::lexical_cast<int>(argv[++i]);
+			} else if( arg == "--sgd-batch" ) {
+				sgdBatch = boost::lexical_cast<int>(argv[++i]);
+				if( sgdBatch < 1 ) {
+					throw Error("sgd batch size must be positive");
+				}
 			} else if( arg == "--set-log-pattern" ) {
 				logPattern = argv[++i];
 			} else if( arg == "--cache-size" ) {
-				cacheSize = boost::lexical_cast<int>(argv[++i]);
+				++i; // wg は文毎に全てのエッジの表を持つようになったので、互換のために受け付けて無視する
+			} else if( arg == "--span-feature-cache-size" ) {
+				spanCacheSize = boost::lexical_cast<int>(argv[++i]);
+			} else if( arg == "--hashed-feature-dimension" ) {
+				hashedDim = boost::lexical_cast<int>(argv[++i]);
+			} else if( arg == "--hashed-feature-templates" ) {
+				hashedTemplates = argv[++i];
+			} else if( arg == "--enable-transition-constraint" ) {
+				flg |= SemiCrf::ENABLE_TRANSITION_CONSTRAINT;
+			} else if( arg == "--disable-transition-constraint" ) {
+				flg |= SemiCrf::DISABLE_TRANSITION_CONSTRAINT;
 			} else if( arg == "--enable-likelihood-only" ) {
 				flg |= SemiCrf::ENABLE_LIKELIHOOD_ONLY;
 			} else if( arg == "--disable-adagrad" ) {
 				flg |= SemiCrf::DISABLE_ADAGRAD;
+			} else if( arg == "--line-search" ) {
+				std::string s = argv[++i];
+				if( s == "wolfe" ) {
+					flg |= SemiCrf::ENABLE_WOLFE_SEARCH;
+				} else if( s != "armijo" ) {
+					throw Error("unknown line search specified");
+				}
 			} else if( arg == "--disable-date-version" ) {
 				flg |= SemiCrf::DISABLE_DATE_VERSION;
 			} else if( arg == "--disable-regularization" ) {
@@ -110,6 +272,10 @@ void Options::parse(int argc, char *argv[])
 			throw Error("both training data file and inference data file specified");
 		}
 
+		if( resume && checkpointFile.empty() ) {
+			throw Error("no checkpoint file specified to resume from");
+		}
+
 		if( weightsFile.empty() && (
 				(!(flg & SemiCrf::ENABLE_LIKELIHOOD_ONLY) && !(trainingDataFile.empty())) ||
 				(!(predictionDataFile.empty()))) ) {
@@ -176,12 +342,28 @@ decltype( std::make_shared<SemiCrf::Algorithm>() ) createAlgorithm(const Options
 	if( maxLengthLimit < alg->getMaxLength() ) {
 		Logger::out()->warn("maxLength exceeds the limit of {}", maxLengthLimit);
 	}
+	alg->setLengthQuantile(options.lengthQuantile);
+	alg->setBeam(options.beamThreshold, options.beamMinLength);
+	alg->setCoarseMargin(options.coarseMargin);
+	alg->setCandidateMinLength(options.candidateMinLength);
+	alg->setParallel(options.threads, options.parallelMinLength);
 	alg->setMaxIteration(options.maxIteration);
 	alg->setE0(options.e0);
 	alg->setE1(options.e1);
 	alg->setRp(options.rp);
+	alg->setL1(options.l1);
+	alg->setEpochs(options.epochs, options.shuffleSeed);
+	alg->setPassiveAggressive(options.paC);
+	alg->setSgd(options.sgdRate, options.sgdBatch);
+	alg->setCheckpoint(options.checkpointFile, options.checkpointIterations, options.checkpointSeconds, options.resume);
+	alg->setWarmStart(options.warmStartFile);
+	alg->setIncremental(options.oldPages, options.newDataWeight, options.oldDataFraction);
+	alg->setDev(options.devFraction, options.devPatience);
+	alg->setNoneFraction(options.noneFraction);
+	alg->setCrossValidation(options.cvFolds, options.sweep);
 	alg->setMethod(options.method);
-	alg->setCacheSize(options.cacheSize);
+	alg->setSpanCacheSize(options.spanCacheSize);
+	alg->setHashedFeature(options.hashedTemplates, options.hashedDim);
 
 	return alg;
 }
@@ -1,12 +1,17 @@
 // © 2016 PORT INC.
 
 #include <sstream>
+#include <fstream>
+#include <cmath>
+#include <limits>
+#include <typeinfo>
 #include <boost/numeric/ublas/io.hpp>
 #include <boost/format.hpp>
 #include "Optimizer.hpp"
 #include "Error.hpp"
 #include "Logger.hpp"
 #include "Signal.hpp"
+#include "FileIO.hpp"
 
 namespace Optimizer {
 
@@ -29,6 +34,14 @@ namespace Optimizer {
 		, r0(0.0)
 		, re(1.0e-6)
 		, ae(1.0e-6)
+		, c1(1.0e-4)
+		, c2(0.9)
+		, l1(0.0)
+		, evaluations(0)
+		, lastEvaluations(0)
+		, checkpointIterations(0)
+		, checkpointSeconds(0.0)
+		, lastCheckpointItr(0)
 		, x(dim)
 		, dx(dim)
 		, g0(dim)
@@ -63,7 +76,7 @@ namespace Optimizer {
 		// 目的関数で数値的な問題が発生しないかチェックする
 		while(1) {
 			try {
-				f1 = ofunc->value(x1);
+				f1 = evaluateValue(x1);
 				break;
 			} catch(Error& e) {
 				// 問題があれば beta1 を小さくして再試行
@@ -81,7 +94,7 @@ namespace Optimizer {
 		// 目的関数の勾配で数値的な問題が発生しないかチェックする
 		while(1) {
 			try {
-				ofunc->grad(x1);
+				evaluateGrad(x1);
 				break;
 			} catch(Error& e) {
 				// 問題があれば beta1 を小さくして再試行
@@ -104,7 +117,7 @@ namespace Optimizer {
 		int counter = 0;
 		vector x1;
 		double gd = inner_prod(g0, d);
-		double f0 = ofunc->value(x);
+		double f0 = evaluateValue(x);
 		double f1 = 0.0;
 		Logger::debug("avoidDivergence");
 		double beta1 = avoidDivergence(d, f1);
@@ -112,7 +125,7 @@ namespace Optimizer {
 		while( xi*beta1*gd < f1 - f0 ) { // Armijo's rule
 			beta1 *= tau;
 			x1 = x + beta1*d;
-			f1 = ofunc->value(x1);
+			f1 = evaluateValue(x1);
 			if( counter++ == maxIteration ) {
 				iteration_limit_error("", beta1);
 			} else if( beta1 < minBeta ) {
@@ -129,6 +142,260 @@ namespace Optimizer {
 		return beta1;
 	}
 
+	// 値と勾配を一度に求める、勾配を求める過程で値も求まり savedValue で読める
+	double UnconstrainedNLP_::evaluate(vector& x1, vector& g1)
+	{
+		++evaluations;
+		g1 = ofunc->grad(x1);
+		return ofunc->savedValue();
+	}
+
+	double UnconstrainedNLP_::evaluateValue(vector& x1)
+	{
+		++evaluations;
+		return ofunc->value(x1);
+	}
+
+	vector UnconstrainedNLP_::evaluateGrad(vector& x1)
+	{
+		++evaluations;
+		return ofunc->grad(x1);
+	}
+
+	// 反復毎の評価回数
+	void UnconstrainedNLP_::reportEvaluations()
+	{
+		Logger::out()->debug( "evaluations: {} in iteration {} ({} in total)", evaluations - lastEvaluations, itr, evaluations );
+		lastEvaluations = evaluations;
+	}
+
+	void UnconstrainedNLP_::setCheckpoint(const std::string& file, int iterations, double seconds)
+	{
+		checkpointFile = file;
+		checkpointIterations = iterations;
+		checkpointSeconds = seconds;
+		lastCheckpoint = std::chrono::steady_clock::now();
+	}
+
+	// 反復の終わりに呼び、間隔に達していれば途中の状態を書く、force なら間隔によらず書く
+	void UnconstrainedNLP_::checkpoint(bool force)
+	{
+		if( checkpointFile.empty() ) {
+			return;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::duration<double> elapsed = now - lastCheckpoint;
+		if( !force
+			&& !( 0 < checkpointIterations && checkpointIterations <= itr - lastCheckpointItr )
+			&& !( 0.0 < checkpointSeconds && checkpointSeconds <= elapsed.count() ) ) {
+			return;
+		}
+
+		writeAtomically(checkpointFile, [this](std::ostream& os) {
+			os.precision(std::numeric_limits<double>::max_digits10);
+			os << typeid(*this).name() << " " << dim << std::endl;
+			saveState(os);
+		});
+		lastCheckpoint = now;
+		lastCheckpointItr = itr;
+		Logger::out()->info( "checkpoint: iteration {} written to {}", itr, checkpointFile );
+	}
+
+	// optimize で初期化した後に呼び、再開するなら保存した状態で上書きする
+	// 勾配は読んだ x で求め直すので、目的関数の状態も x に揃う
+	// 温めて始めるときは、x は初期値のまま反復も最初からとし、曲率の情報 (H0、(dx,y) の組など) だけを使う
+	void UnconstrainedNLP_::restore()
+	{
+		bool warm = resumeFile.empty();
+		std::string file = warm ? warmStartFile : resumeFile;
+		if( file.empty() ) {
+			return;
+		}
+
+		vector x0 = x;
+		std::ifstream ifs;
+		open(ifs, file);
+		std::string name;
+		int n = 0;
+		ifs >> name >> n;
+		if( name != typeid(*this).name() || n != dim ) {
+			std::stringstream ss;
+			ss << "checkpoint does not match the optimizer or the dimension: " << file;
+			throw Error(ss.str());
+		}
+		loadState(ifs);
+		if( ifs.fail() ) {
+			std::stringstream ss;
+			ss << "cannot read checkpoint: " << file;
+			throw Error(ss.str());
+		}
+
+		if( warm ) {
+			x = x0;
+			itr = 0;
+			evaluations = lastEvaluations = 0;
+			alpha = beta = 1.0;
+			Logger::out()->info( "warm start with the curvature of {}", file );
+		} else {
+			Logger::out()->info( "resume from iteration {} of {}", itr, file );
+		}
+		lastCheckpointItr = itr;
+	}
+
+	void UnconstrainedNLP_::saveState(std::ostream& os)
+	{
+		os << itr << " " << evaluations << " " << alpha << " " << beta << " " << r0 << " " << f0 << std::endl;
+		os << x << std::endl;
+	}
+
+	void UnconstrainedNLP_::loadState(std::istream& is)
+	{
+		is >> itr >> evaluations >> alpha >> beta >> r0 >> f0 >> x;
+		lastEvaluations = evaluations;
+	}
+
+	// 強 Wolfe 条件を満たす歩幅を探す (Nocedal & Wright, Algorithm 3.5)
+	// 試す点毎に値と勾配を一度に求め、受け入れた点の値を f1、勾配を g1 に返すので、呼び出し側で勾配を求め直さなくてよい
+	double UnconstrainedNLP_::wolfeSearch(vector& d, double f0, double& f1, vector& g1)
+	{
+		double gd0 = inner_prod(g0, d);
+		if( 0.0 <= gd0 ) {
+			throw Error("wolfeSearch: not a descent direction");
+		}
+
+		double a0 = 0.0;
+		double fa0 = f0;
+		double ga0 = gd0;
+		double a1 = 1.0;
+		std::string msg;
+
+		for( int counter = 0; ; counter++ ) {
+
+			if( counter == maxIteration ) {
+				iteration_limit_error(msg, a1);
+			} else if( a1 < minBeta ) {
+				minimum_limit_error(msg, a1);
+			}
+
+			vector x1 = x + a1*d;
+			vector gv(dim);
+			double fa1;
+			try {
+				fa1 = evaluate(x1, gv);
+			} catch(Error& e) {
+				// 数値的な問題があれば、受け入れられる点に向けて縮める
+				a1 = a0 + (a1 - a0)*tau;
+				msg = e.what();
+				continue;
+			}
+			double ga1 = inner_prod(gv, d);
+
+			if( f0 + c1*a1*gd0 < fa1 || (0.0 < a0 && fa0 <= fa1) ) {
+				return zoom(d, f0, gd0, a0, fa0, ga0, a1, fa1, ga1, f1, g1);
+			}
+			if( std::fabs(ga1) <= -c2*gd0 ) {
+				f1 = fa1;
+				g1 = gv;
+				return a1;
+			}
+			if( 0.0 <= ga1 ) {
+				return zoom(d, f0, gd0, a1, fa1, ga1, a0, fa0, ga0, f1, g1);
+			}
+			if( Signal::getFlg() ) {
+				Logger::info("liner search interrrputed");
+				f1 = fa1;
+				g1 = gv;
+				return a1;
+			}
+
+			a0 = a1;
+			fa0 = fa1;
+			ga0 = ga1;
+			a1 *= 2.0;
+		}
+	}
+
+	// [alo, ahi] を三次補間で狭めて強 Wolfe 条件を満たす点を探す (Nocedal & Wright, Algorithm 3.6)
+	// alo は十分減少を満たす点のうち値が最小のもの
+	double UnconstrainedNLP_::zoom(vector& d, double f0, double gd0,
+		double alo, double flo, double glo,
+		double ahi, double fhi, double ghi,
+		double& f1, vector& g1)
+	{
+		std::string msg;
+
+		for( int counter = 0; ; counter++ ) {
+
+			// 幅が無くなったか打ち切るときは、十分減少を満たしている alo を返す
+			bool stop = std::fabs(ahi - alo) < minBeta || counter == maxIteration || Signal::getFlg();
+			if( stop ) {
+				if( alo == 0.0 ) {
+					if( counter == maxIteration ) {
+						iteration_limit_error(msg, ahi);
+					}
+					minimum_limit_error(msg, ahi);
+				}
+				// 最後に評価した点と違うので、savedValue と目的関数の状態を alo に合わせる
+				vector x1 = x + alo*d;
+				f1 = evaluate(x1, g1);
+				return alo;
+			}
+
+			// 両端の値と傾きによる三次補間、区間の端に寄りすぎるときは二分する
+			double a;
+			double d1 = glo + ghi - 3.0*(flo - fhi)/(alo - ahi);
+			double r = d1*d1 - glo*ghi;
+			double w = std::fabs(ahi - alo);
+			if( 0.0 <= r && std::isfinite(d1) && std::isfinite(fhi) ) {
+				double d2 = ( alo < ahi ? 1.0 : -1.0 )*std::sqrt(r);
+				a = ahi - (ahi - alo)*(ghi + d2 - d1)/(ghi - glo + 2.0*d2);
+			} else {
+				a = 0.5*(alo + ahi);
+			}
+			double lo = std::min(alo, ahi) + 0.1*w;
+			double hi = std::max(alo, ahi) - 0.1*w;
+			if( !std::isfinite(a) || a < lo || hi < a ) {
+				a = 0.5*(alo + ahi);
+			}
+
+			vector x1 = x + a*d;
+			vector gv(dim);
+			double fa;
+			try {
+				fa = evaluate(x1, gv);
+			} catch(Error& e) {
+				// 数値的な問題がある点は値が大きいものとして区間から外す
+				ahi = a;
+				fhi = std::numeric_limits<double>::infinity();
+				ghi = 0.0;
+				msg = e.what();
+				continue;
+			}
+			double ga = inner_prod(gv, d);
+
+			if( f0 + c1*a*gd0 < fa || flo <= fa ) {
+				ahi = a;
+				fhi = fa;
+				ghi = ga;
+			} else {
+				if( std::fabs(ga) <= -c2*gd0 ) {
+					f1 = fa;
+					g1 = gv;
+					return a;
+				}
+				if( 0.0 <= ga*(ahi - alo) ) {
+					ahi = alo;
+					fhi = flo;
+					ghi = glo;
+				}
+				alo = a;
+				flo = fa;
+				glo = ga;
+			}
+		}
+	}
+
 	bool UnconstrainedNLP_::isConv()
 	{
 		bool flg = false;
@@ -142,10 +409,15 @@ namespace Optimizer {
 
 			double err = r/(r0*re + ae);
 			flg = ( err < 1.0 );
-			double f = ofunc->value(x);
+			double f = evaluateValue(x);
 			Logger::info() << boost::format("f= %10.6e |∇f|= %10.6e alp=%10.6e") % f % err % alpha;
 		}
 
+		if( !flg && 0 < itr && ofunc->isStopped(x) ) {
+			Logger::info() << "stopped by objective function";
+			flg = true;
+		}
+
 		if( !flg && itr == maxIteration ) {
 			std::string msg("iteration limit");
 			Logger::info(msg.c_str());
@@ -177,10 +449,12 @@ namespace Optimizer {
 	{
 		Logger::debug("preProcess");
 		ofunc->preProcess(x);
+		restore();
 
 		Logger::debug("grad");
-		g0 = ofunc->grad(x);                 Logger::trace() << "g0=" << g0;
+		g0 = evaluateGrad(x);                 Logger::trace() << "g0=" << g0;
 		alpha = 1.0;
+		bool wolfe = ( flg & ENABLE_WOLFE ) && !( flg & ENABLE_ADAGRAD );
 
 		while(1) {
 
@@ -198,6 +472,10 @@ namespace Optimizer {
 				double f1 = 0.0;
 				Logger::debug("avoidDivergence");
 				alpha = avoidDivergence(d, f1);
+			} else if( wolfe ) {
+				Logger::debug("wolfeSearch");
+				double f1 = 0.0;
+				alpha = wolfeSearch(d, ofunc->savedValue(), f1, g1);
 			} else {
 				Logger::debug("linearSearch");
 				alpha = linearSearch(d);
@@ -209,19 +487,40 @@ namespace Optimizer {
 			Logger::debug("afterUpdateXProcess");
 			ofunc->afterUpdateXProcess(x);
 			if( isConv() ) break;
-			Logger::debug("grad");
-			g0 = ofunc->grad(x);             Logger::trace() << "g0=" << g0;
+			if( wolfe ) {
+				g0 = g1; // 直線探索で受け入れた点の勾配を使う
+			} else {
+				Logger::debug("grad");
+				g0 = evaluateGrad(x);             Logger::trace() << "g0=" << g0;
+			}
+			reportEvaluations();
 
 			Logger::debug("endLoopProcess");
 			ofunc->endLoopProcess(x);
 
 			++itr;
+			checkpoint();
 		}
 
+		// 割り込まれたときも収束したときも、間隔によらず書いておく (次の学習を温めて始められる)
+		checkpoint(true);
+
 		Logger::debug("postProcess");
 		ofunc->postProcess(x);
 	}
 
+	void SteepestDescent::saveState(std::ostream& os)
+	{
+		UnconstrainedNLP_::saveState(os);
+		os << adagrad << std::endl;
+	}
+
+	void SteepestDescent::loadState(std::istream& is)
+	{
+		UnconstrainedNLP_::loadState(is);
+		is >> adagrad;
+	}
+
 	bool SteepestDescent::isConv()
 	{
 		bool flg = false;
@@ -241,6 +540,11 @@ namespace Optimizer {
 			Logger::info() << boost::format("f= %10.6e |∇f|= %10.6e alp=%10.6e") % f % err % alpha;
 		}
 
+		if( !flg && 0 < itr && ofunc->isStopped(x) ) {
+			Logger::info() << "stopped by objective function";
+			flg = true;
+		}
+
 		if( !flg && itr == maxIteration ) {
 			std::string msg("iteration limit");
 			Logger::info(msg.c_str());
@@ -274,8 +578,9 @@ namespace Optimizer {
 		ofunc->preProcess(x);
 
 		H0 = I;
+		restore();
 		Logger::debug("grad");
-		g0 = ofunc->grad(x);                 Logger::trace() << "g0=" << g0;
+		g0 = evaluateGrad(x);                 Logger::trace() << "g0=" << g0;
 		alpha = 1.0;
 
 		while(1) {
@@ -285,31 +590,62 @@ namespace Optimizer {
 
 			Logger::debug("prod");
 			d = - prod(H0, g0);              Logger::trace() << "d=" << d;
-			Logger::debug("linearSearch");
-			alpha = linearSearch(d);
+			if( flg & ENABLE_WOLFE ) {
+				if( 0.0 <= inner_prod(g0, d) ) {
+					// 降下方向でなければ最急降下からやり直す
+					Logger::debug("reset matrix");
+					H0 = I;
+					d = - g0;
+				}
+				Logger::debug("wolfeSearch");
+				double f1 = 0.0;
+				alpha = wolfeSearch(d, ofunc->savedValue(), f1, g1);
+			} else {
+				Logger::debug("linearSearch");
+				alpha = linearSearch(d);
+			}
 			dx = alpha * d;                  Logger::trace() << "dx=" << dx;
 			Logger::debug("update x");
 			x = x + dx;                      Logger::trace() << "x=" << x;
 			Logger::debug("afterUpdateXProcess");
 			ofunc->afterUpdateXProcess(x);
 			if( isConv() ) break;
-			Logger::debug("grad");
-			g1 = ofunc->grad(x);             Logger::trace() << "g1=" << g1;
+			if( !( flg & ENABLE_WOLFE ) ) {
+				Logger::debug("grad");
+				g1 = evaluateGrad(x);             Logger::trace() << "g1=" << g1;
+			} // Wolfe 条件の直線探索では受け入れた点の勾配が g1 に求めてある
 			y = g1 - g0;                     Logger::trace() << "y=" << y;
 			g0 = g1;
 			Logger::debug("update matrix");
 			updateMatrix();
+			reportEvaluations();
 
 			Logger::debug("endLoopProcess");
 			ofunc->endLoopProcess(x);
 
 			++itr;
+			checkpoint();
 		}
 
+		// 割り込まれたときも収束したときも、間隔によらず書いておく (次の学習を温めて始められる)
+		checkpoint(true);
+
 		Logger::debug("postProcess");
 		ofunc->postProcess(x);
 	}
 
+	void QuasiNewton_::saveState(std::ostream& os)
+	{
+		UnconstrainedNLP_::saveState(os);
+		os << H0 << std::endl;
+	}
+
+	void QuasiNewton_::loadState(std::istream& is)
+	{
+		UnconstrainedNLP_::loadState(is);
+		is >> H0;
+	}
+
 	bool QuasiNewton_::isConv()
 	{
 		bool flg = false;
@@ -331,6 +667,11 @@ namespace Optimizer {
 			f0 = f;
 		}
 
+		if( !flg && 0 < itr && ofunc->isStopped(x) ) {
+			Logger::info() << "stopped by objective function";
+			flg = true;
+		}
+
 		if( !flg && itr == maxIteration ) {
 			std::string msg("iteration limit");
 			Logger::info(msg.c_str());
@@ -368,6 +709,493 @@ namespace Optimizer {
 
 	////////
 
+	UnconstrainedNLP createOwlQn(int dim, ObjectiveFunction ofunc)
+	{
+		return std::shared_ptr<UnconstrainedNLP_>( new OwlQn(dim, ofunc) );
+	}
+
+	OwlQn::OwlQn(int dim, ObjectiveFunction ofunc)
+		: UnconstrainedNLP_(dim, ofunc)
+		, m(10)
+		, F(0.0)
+	{
+	}
+
+	static double sign(double v)
+	{
+		return ( 0.0 < v ) ? 1.0 : ( v < 0.0 ) ? -1.0 : 0.0;
+	}
+
+	double OwlQn::l1Norm(const vector& v) const
+	{
+		double n = 0.0;
+		for( auto e : v ) {
+			n += std::fabs(e);
+		}
+		return n;
+	}
+
+	// x_i が 0 の成分では、どちらの向きに動かしても減らないなら 0 とする
+	void OwlQn::pseudoGradient(const vector& g, vector& pg) const
+	{
+		for( int i = 0; i < dim; i++ ) {
+			if( x[i] < 0.0 ) {
+				pg[i] = g[i] - l1;
+			} else if( 0.0 < x[i] ) {
+				pg[i] = g[i] + l1;
+			} else if( g[i] + l1 < 0.0 ) {
+				pg[i] = g[i] + l1;
+			} else if( 0.0 < g[i] - l1 ) {
+				pg[i] = g[i] - l1;
+			} else {
+				pg[i] = 0.0;
+			}
+		}
+	}
+
+	// d = - H pg
+	void OwlQn::twoLoop(const vector& pg, vector& d) const
+	{
+		int k = dxs.size();
+		std::vector<double> a(k);
+		vector q = pg;
+		for( int j = k-1; 0 <= j; j-- ) {
+			a[j] = inner_prod(dxs[j], q)/inner_prod(ys[j], dxs[j]);
+			q -= a[j]*ys[j];
+		}
+		if( 0 < k ) {
+			q *= inner_prod(dxs[k-1], ys[k-1])/inner_prod(ys[k-1], ys[k-1]);
+		}
+		for( int j = 0; j < k; j++ ) {
+			double b = inner_prod(ys[j], q)/inner_prod(ys[j], dxs[j]);
+			q += (a[j] - b)*dxs[j];
+		}
+		d = -q;
+	}
+
+	// 象限を保ったままのバックトラック、象限をまたいだ成分は 0 に射影する
+	// 試す点毎に値と勾配を一度に求め、受け入れた点を x1、勾配を g1 に返す
+	double OwlQn::search(const vector& pg, double F0, double& F1, vector& x1, vector& g1)
+	{
+		vector orthant(dim);
+		for( int i = 0; i < dim; i++ ) {
+			orthant[i] = ( x[i] != 0.0 ) ? sign(x[i]) : sign(-pg[i]);
+		}
+
+		// 最初の反復では方向の大きさが分からないので、歩幅を 1/|d| から始める
+		double a = ( itr == 0 ) ? std::min(1.0, 1.0/norm_2(d)) : 1.0;
+		std::string msg;
+
+		for( int counter = 0; ; counter++ ) {
+
+			if( counter == maxIteration ) {
+				iteration_limit_error(msg, a);
+			} else if( a < minBeta ) {
+				minimum_limit_error(msg, a);
+			}
+
+			x1 = x + a*d;
+			for( int i = 0; i < dim; i++ ) {
+				if( sign(x1[i]) != orthant[i] ) {
+					x1[i] = 0.0;
+				}
+			}
+
+			try {
+				F1 = evaluate(x1, g1) + l1*l1Norm(x1);
+			} catch(Error& e) {
+				a *= tau;
+				msg = e.what();
+				continue;
+			}
+
+			if( F1 <= F0 + c1*inner_prod(pg, x1 - x) ) {
+				break;
+			}
+			if( Signal::getFlg() ) {
+				Logger::info("liner search interrrputed");
+				break;
+			}
+			a *= 0.5;
+		}
+
+		return a;
+	}
+
+	void OwlQn::optimize()
+	{
+		Logger::debug("preProcess");
+		ofunc->preProcess(x);
+		restore();
+
+		Logger::debug("grad");
+		g0 = evaluateGrad(x);                 Logger::trace() << "g0=" << g0;
+		F = ofunc->savedValue() + l1*l1Norm(x);
+		alpha = 1.0;
+
+		vector pg(dim);
+		vector x1(dim);
+
+		while(1) {
+
+			Logger::debug("beginLoopProcess");
+			ofunc->beginLoopProcess(x);
+
+			pseudoGradient(g0, pg);
+			twoLoop(pg, d);
+
+			// 擬似勾配で降りない成分は動かさない、それでも降下方向でなければ最急降下からやり直す
+			// L1 が無ければ L-BFGS そのものなので、成分を落とさない
+			for( int i = 0; i < dim; i++ ) {
+				if( 0.0 < l1 && 0.0 <= d[i]*pg[i] ) {
+					d[i] = 0.0;
+				}
+			}
+			if( 0.0 <= inner_prod(d, pg) ) {
+				Logger::debug("reset memory");
+				dxs.clear();
+				ys.clear();
+				d = -pg;
+			}                                Logger::trace() << "d=" << d;
+
+			Logger::debug("search");
+			double F1 = 0.0;
+			alpha = search(pg, F, F1, x1, g1);
+			dx = x1 - x;                     Logger::trace() << "dx=" << dx;
+			Logger::debug("update x");
+			x = x1;                          Logger::trace() << "x=" << x;
+			F = F1;
+			Logger::debug("afterUpdateXProcess");
+			ofunc->afterUpdateXProcess(x);
+			if( isConv() ) break;
+
+			// 曲率が正の組だけを覚える
+			vector y = g1 - g0;
+			if( 0.0 < inner_prod(dx, y) ) {
+				dxs.push_back(dx);
+				ys.push_back(y);
+				if( m < dxs.size() ) {
+					dxs.pop_front();
+					ys.pop_front();
+				}
+			}
+			g0 = g1;
+			reportEvaluations();
+
+			Logger::debug("endLoopProcess");
+			ofunc->endLoopProcess(x);
+
+			++itr;
+			checkpoint();
+		}
+
+		// 割り込まれたときも収束したときも、間隔によらず書いておく (次の学習を温めて始められる)
+		checkpoint(true);
+
+		Logger::debug("postProcess");
+		ofunc->postProcess(x);
+	}
+
+	void OwlQn::saveState(std::ostream& os)
+	{
+		UnconstrainedNLP_::saveState(os);
+		os << dxs.size() << std::endl;
+		for( int j = 0; j < dxs.size(); j++ ) {
+			os << dxs[j] << std::endl << ys[j] << std::endl;
+		}
+	}
+
+	void OwlQn::loadState(std::istream& is)
+	{
+		UnconstrainedNLP_::loadState(is);
+		int k = 0;
+		is >> k;
+		dxs.assign(k, vector(dim));
+		ys.assign(k, vector(dim));
+		for( int j = 0; j < k; j++ ) {
+			is >> dxs[j] >> ys[j];
+		}
+	}
+
+	// 収束は L1 を含む値の相対変化で見る
+	bool OwlQn::isConv()
+	{
+		bool flg = false;
+		double r = sqrt(inner_prod(g0, g0));
+
+		if( itr == 0 ) {
+
+			r0 = r;
+			f0 = F;
+
+		} else {
+
+			double err0 = r/(r0*re + ae);
+			double err1 = fabs( (F - f0)/(re*f0+ae) );
+			flg = ( err1 < 1.0 );
+			int nnz = 0;
+			for( auto e : x ) {
+				if( e != 0.0 ) ++nnz;
+			}
+			Logger::info() << boost::format("f= %10.6e |∇f|= %10.6e |Δf/f|= %10.6e alp= %10.6e nnz= %d") % F % err0 % err1 % alpha % nnz;
+			f0 = F;
+		}
+
+		if( !flg && 0 < itr && ofunc->isStopped(x) ) {
+			Logger::info() << "stopped by objective function";
+			flg = true;
+		}
+
+		if( !flg && itr == maxIteration ) {
+			std::string msg("iteration limit");
+			Logger::info(msg.c_str());
+			throw Error(msg);
+		}
+
+		if( Signal::getFlg() ) {
+			Logger::info() << "interrupt signal received";
+			flg = true;
+		}
+
+		return flg;
+	}
+
+	////////
+
+	UnconstrainedNLP createTruncatedNewton(int dim, ObjectiveFunction ofunc)
+	{
+		return std::shared_ptr<UnconstrainedNLP_>( new TruncatedNewton(dim, ofunc) );
+	}
+
+	TruncatedNewton::TruncatedNewton(int dim, ObjectiveFunction ofunc)
+		: UnconstrainedNLP_(dim, ofunc)
+		, radius(1.0)
+		, maxRadius(1.0e+8)
+		, cgMaxIteration(50)
+		, cgIterations(0)
+		, F(0.0)
+	{
+	}
+
+	// H v を x での勾配 g0 との前進差分で近似する
+	void TruncatedNewton::hessVec(const vector& v, vector& hv)
+	{
+		double nv = norm_2(v);
+		if( nv == 0.0 ) {
+			hv = zero_vector<double>(dim);
+			return;
+		}
+		double eps = sqrt(std::numeric_limits<double>::epsilon())*(1.0 + norm_2(x))/nv;
+		vector x1 = x + eps*v;
+		hv = (evaluateGrad(x1) - g0)/eps;
+	}
+
+	// 二次模型 g0.p + p.Hp/2 を |p| <= radius で近似的に最小化する (Nocedal & Wright, Algorithm 7.2)
+	// 負の曲率か境界に当たれば境界まで伸ばし、boundary を真にする、模型の値を返す
+	double TruncatedNewton::steihaug(vector& p, bool& boundary)
+	{
+		p = zero_vector<double>(dim);
+		boundary = false;
+
+		double ng = norm_2(g0);
+		double tol = std::min(0.5, sqrt(ng))*ng; // 勾配が小さくなるほど厳しく解く
+		vector r = g0;
+		vector hp = zero_vector<double>(dim);
+		vector hd(dim);
+		d = -r;
+		double rr = inner_prod(r, r);
+
+		// 境界 |p + t d| = radius までの t
+		auto toBoundary = [&]() {
+			double pd = inner_prod(p, d);
+			double dd = inner_prod(d, d);
+			double pp = inner_prod(p, p);
+			return (-pd + sqrt(pd*pd + dd*(radius*radius - pp)))/dd;
+		};
+
+		for( int j = 0; j < cgMaxIteration && tol < sqrt(rr); j++ ) {
+
+			++cgIterations;
+			hessVec(d, hd);
+			double dhd = inner_prod(d, hd);
+
+			if( dhd <= 0.0 ) {
+				Logger::debug("negative curvature");
+				double t = toBoundary();
+				p += t*d;
+				hp += t*hd;
+				boundary = true;
+				break;
+			}
+
+			double a = rr/dhd;
+			if( radius <= norm_2(p + a*d) ) {
+				double t = toBoundary();
+				p += t*d;
+				hp += t*hd;
+				boundary = true;
+				break;
+			}
+
+			p += a*d;
+			hp += a*hd;
+			r += a*hd;
+			double rr1 = inner_prod(r, r);
+			d = -r + (rr1/rr)*d;
+			rr = rr1;
+
+			if( Signal::getFlg() ) {
+				break;
+			}
+		}
+
+		return inner_prod(g0, p) + 0.5*inner_prod(p, hp);
+	}
+
+	void TruncatedNewton::optimize()
+	{
+		Logger::debug("preProcess");
+		ofunc->preProcess(x);
+		restore();
+
+		Logger::debug("grad");
+		g0 = evaluateGrad(x);                 Logger::trace() << "g0=" << g0;
+		F = ofunc->savedValue();
+		alpha = radius;
+
+		vector p(dim);
+		vector x1(dim);
+
+		while(1) {
+
+			Logger::debug("beginLoopProcess");
+			ofunc->beginLoopProcess(x);
+
+			// 模型と実際の減少の比で半径を変え、十分に減らない一歩は捨てる
+			double F1 = 0.0;
+			bool accepted = false;
+			for( int counter = 0; !accepted; counter++ ) {
+
+				if( counter == maxIteration ) {
+					iteration_limit_error("", radius);
+				} else if( radius < minBeta ) {
+					minimum_limit_error("", radius);
+				}
+
+				Logger::debug("steihaug");
+				bool boundary = false;
+				double m = steihaug(p, boundary);
+				if( 0.0 <= m ) {
+					Logger::debug("no model decrease");
+					radius *= 0.25;
+					continue;
+				}
+
+				x1 = x + p;
+				double rho = -std::numeric_limits<double>::infinity();
+				try {
+					F1 = evaluate(x1, g1);
+					rho = (F1 - F)/m;
+				} catch(Error& e) {
+					Logger::debug(e.what().c_str());
+				}
+
+				if( rho < 0.25 ) {
+					radius = 0.25*norm_2(p);
+				} else if( 0.75 < rho && boundary ) {
+					radius = std::min(2.0*radius, maxRadius);
+				}
+				accepted = ( c1 < rho );
+				Logger::trace() << "rho=" << rho << " radius=" << radius;
+
+				if( Signal::getFlg() ) {
+					Logger::info("trust region search interrrputed");
+					break;
+				}
+			}
+
+			if( !accepted ) {
+				break;
+			}
+
+			dx = p;                          Logger::trace() << "dx=" << dx;
+			alpha = norm_2(dx);
+			Logger::debug("update x");
+			x = x1;                          Logger::trace() << "x=" << x;
+			F = F1;
+			g0 = g1;
+			Logger::debug("afterUpdateXProcess");
+			ofunc->afterUpdateXProcess(x);
+			if( isConv() ) break;
+			reportEvaluations();
+
+			Logger::debug("endLoopProcess");
+			ofunc->endLoopProcess(x);
+
+			++itr;
+			checkpoint();
+		}
+
+		// 割り込まれたときも収束したときも、間隔によらず書いておく (次の学習を温めて始められる)
+		checkpoint(true);
+
+		Logger::debug("postProcess");
+		ofunc->postProcess(x);
+	}
+
+	void TruncatedNewton::saveState(std::ostream& os)
+	{
+		UnconstrainedNLP_::saveState(os);
+		os << radius << " " << cgIterations << std::endl;
+	}
+
+	void TruncatedNewton::loadState(std::istream& is)
+	{
+		UnconstrainedNLP_::loadState(is);
+		is >> radius >> cgIterations;
+	}
+
+	// 収束は値の相対変化で見る、|Δx| を alp として出す
+	bool TruncatedNewton::isConv()
+	{
+		bool flg = false;
+		double r = sqrt(inner_prod(g0, g0));
+
+		if( itr == 0 ) {
+
+			r0 = r;
+			f0 = F;
+
+		} else {
+
+			double err0 = r/(r0*re + ae);
+			double err1 = fabs( (F - f0)/(re*f0+ae) );
+			flg = ( err1 < 1.0 );
+			Logger::info() << boost::format("f= %10.6e |∇f|= %10.6e |Δf/f|= %10.6e alp= %10.6e cg= %d") % F % err0 % err1 % alpha % cgIterations;
+			f0 = F;
+		}
+
+		if( !flg && 0 < itr && ofunc->isStopped(x) ) {
+			Logger::info() << "stopped by objective function";
+			flg = true;
+		}
+
+		if( !flg && itr == maxIteration ) {
+			std::string msg("iteration limit");
+			Logger::info(msg.c_str());
+			throw Error(msg);
+		}
+
+		if( Signal::getFlg() ) {
+			Logger::info() << "interrupt signal received";
+			flg = true;
+		}
+
+		return flg;
+	}
+
+	////////
+
 	class test1 : public ObjectiveFunction_ {
 	public:
 		test1(){}
@@ -382,6 +1210,7 @@ namespace Optimizer {
 			return f;
 		}
 		virtual vector grad(vector& x){
+			value(x);
 			vector g(2);
 			g(0) = x[0]-x[1]*x[1];
 			double a = (x[1]-2);
@@ -417,6 +1246,7 @@ namespace Optimizer {
 			return f;
 		}
 		virtual vector grad(vector& x){
+			value(x);
 			vector g(2);
 			g(0) = -400*(x[1]-x[0]*x[0])*x[0] - 2*(1-x[0]);
 			g(1) = 200*(x[1]-x[0]*x[0]);
@@ -3,6 +3,10 @@
 #ifndef OPTIMIZATION__HPP
 #define OPTIMIZATION__HPP
 
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <string>
 #include <boost/numeric/ublas/matrix.hpp>
 #include <boost/numeric/ublas/vector.hpp>
 
@@ -14,6 +18,7 @@ namespace Optimizer {
 
 	enum {
 		ENABLE_ADAGRAD = 0x1
+		, ENABLE_WOLFE = (0x1 << 1) // Armijo のバックトラックの代わりに強 Wolfe 条件で直線探索する
 	};
 
 	////////
@@ -30,6 +35,7 @@ namespace Optimizer {
 		virtual void afterUpdateXProcess(vector& x) = 0;
 		virtual void endLoopProcess(vector& x) = 0;
 		virtual void postProcess(vector& x) = 0;
+		virtual bool isStopped(vector&) { return false; } // 収束を待たずに止めるなら真
 	};
 
 	typedef std::shared_ptr<ObjectiveFunction_> ObjectiveFunction;
@@ -49,11 +55,29 @@ namespace Optimizer {
 		void setMaxIteration(int arg) { maxIteration = arg; };
 		void setE0(double arg) { e0 = arg; };
 		void setFlg(int arg) { flg = arg; };
+		void setWolfe(double arg1, double arg2) { c1 = arg1; c2 = arg2; };
+		void setL1(double arg) { l1 = arg; };
+		void setCheckpoint(const std::string& file, int iterations, double seconds);
+		void setResume(const std::string& arg) { resumeFile = arg; };
+		void setWarmStart(const std::string& arg) { warmStartFile = arg; };
 
 	protected:
 
 		virtual double avoidDivergence(vector& g, double& f1);
 		virtual double linearSearch(vector& g);
+		virtual double wolfeSearch(vector& d, double f0, double& f1, vector& g1);
+		double zoom(vector& d, double f0, double gd0,
+			double alo, double flo, double glo,
+			double ahi, double fhi, double ghi,
+			double& f1, vector& g1);
+		double evaluate(vector& x1, vector& g1);
+		double evaluateValue(vector& x1);
+		vector evaluateGrad(vector& x1);
+		void reportEvaluations();
+		void checkpoint(bool force = false);
+		void restore();
+		virtual void saveState(std::ostream& os);
+		virtual void loadState(std::istream& is);
 		void iteration_limit_error(std::string msg, double beta);
 		void minimum_limit_error(std::string msg, double beta);
 
@@ -74,6 +98,18 @@ namespace Optimizer {
 		double f0;
 		double re;
 		double ae;
+		double c1; // 強 Wolfe 条件の十分減少の係数
+		double c2; // 強 Wolfe 条件の曲率の係数
+		double l1; // L1 正則化の係数、OWL-QN だけが使う
+		int evaluations; // 目的関数を評価した回数 (値と勾配を一度に求めたものも 1 回)
+		int lastEvaluations;
+		std::string checkpointFile; // 空なら途中の状態を書かない
+		int checkpointIterations; // この反復数毎に書く、0 なら反復数では書かない
+		double checkpointSeconds; // この秒数毎に書く、0 なら時間では書かない
+		int lastCheckpointItr;
+		std::chrono::steady_clock::time_point lastCheckpoint;
+		std::string resumeFile; // 空でなければ optimize の始めに状態を読む
+		std::string warmStartFile; // 空でなければ optimize の始めに x と反復の状態以外を読む
 		vector x;
 		vector dx;
 		vector g0;
@@ -94,6 +130,11 @@ namespace Optimizer {
 		virtual void optimize();
 		virtual bool isConv();
 
+	protected:
+
+		virtual void saveState(std::ostream& os);
+		virtual void loadState(std::istream& is);
+
 	protected:
 
 		vector adagrad;
@@ -118,6 +159,8 @@ namespace Optimizer {
 	protected:
 
 		virtual void updateMatrix() = 0;
+		virtual void saveState(std::ostream& os);
+		virtual void loadState(std::istream& is);
 
 	protected:
 
@@ -141,6 +184,74 @@ namespace Optimizer {
 
 	UnconstrainedNLP createBfgs(int dim, ObjectiveFunction ofunc);
 
+	////////
+
+	// L1 正則化付きの準ニュートン法 (OWL-QN, Andrew & Gao 2007)
+	// 目的関数は滑らかな部分だけを返し、l1*|x|_1 はここで足す
+	// 逆ヘッセ行列は密に持たず、直近 m 組の (dx,y) から L-BFGS の二重ループで掛ける
+	class OwlQn : public UnconstrainedNLP_ {
+
+	public:
+
+		OwlQn(int dim, ObjectiveFunction ofunc);
+		virtual ~OwlQn(){};
+		virtual void optimize();
+		virtual bool isConv();
+		void setMemory(int arg) { m = arg; };
+
+	protected:
+
+		double l1Norm(const vector& v) const;
+		void pseudoGradient(const vector& g, vector& pg) const;
+		void twoLoop(const vector& pg, vector& d) const;
+		double search(const vector& pg, double F0, double& F1, vector& x1, vector& g1);
+		virtual void saveState(std::ostream& os);
+		virtual void loadState(std::istream& is);
+
+	protected:
+
+		int m;
+		double F; // l1*|x|_1 を含む現在の値
+		std::deque<vector> dxs;
+		std::deque<vector> ys;
+	};
+
+	UnconstrainedNLP createOwlQn(int dim, ObjectiveFunction ofunc);
+
+	////////
+
+	// 信頼領域付きの打ち切りニュートン法 (Newton-CG, Steihaug 1983)
+	// ヘッセ行列は持たず、ヘッセ行列とベクトルの積を勾配の差分で求め、共役勾配法で二次模型を信頼領域の中で解く
+	// 積 1 回ごとに勾配を 1 回評価する
+	class TruncatedNewton : public UnconstrainedNLP_ {
+
+	public:
+
+		TruncatedNewton(int dim, ObjectiveFunction ofunc);
+		virtual ~TruncatedNewton(){};
+		virtual void optimize();
+		virtual bool isConv();
+		void setRadius(double arg) { radius = arg; };
+		void setCgMaxIteration(int arg) { cgMaxIteration = arg; };
+
+	protected:
+
+		void hessVec(const vector& v, vector& hv);
+		double steihaug(vector& p, bool& boundary);
+		virtual void saveState(std::ostream& os);
+		virtual void loadState(std::istream& is);
+
+	protected:
+
+		double radius; // 信頼領域の半径
+		double maxRadius;
+		int cgMaxIteration; // 反復毎の共役勾配法の反復の上限
+		int cgIterations; // 共役勾配法の反復の合計
+		double F; // 現在の値
+	};
+
+	UnconstrainedNLP createTruncatedNewton(int dim, ObjectiveFunction ofunc);
+
 	void test();
 
 }
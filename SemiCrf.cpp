@@ -11,6 +11,15 @@
 #include <cassert>
 #include <cmath>
 #include <clocale>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <deque>
+#include <unordered_map>
+#include <random>
+#include <chrono>
+#include <algorithm>
 #include "SemiCrf.hpp"
 #include "FeatureFunction.hpp"
 #include "MultiByteTokenizer.hpp"
@@ -19,6 +28,8 @@
 #include "ujson.hpp"
 #include "JsonIO.hpp"
 #include "Signal.hpp"
+#include "Kernel.hpp"
+#include "FileIO.hpp"
 
 namespace SemiCrf {
 
@@ -27,16 +38,116 @@ namespace SemiCrf {
 		return std::make_shared<CheckTable_>(capacity, CheckTuple());
 	}
 
-	CheckVTable createCheckVTable(int capacity)
+	//// EdgeTable ////
+
+	long long EdgeTable::reset(int s, const std::vector<int>& arg_lengths, const std::vector<const std::vector<Label>*>& preds, long long limit, bool arg_features, long long arg_featureLimit)
 	{
-		return std::make_shared<CheckVTable_>(capacity, CheckPair());
+		l = arg_lengths.size();
+		lengths = arg_lengths;
+		offsets.assign(l, 0);
+		counts.assign(l, 0);
+		slots.assign(l*l, -1);
+		row = 0;
+		for( int y = 0; y < l; y++ ) {
+			offsets[y] = row;
+			for( auto yd : *preds[y] ) {
+				slots[y*l+yd] = counts[y]++;
+			}
+			row += static_cast<long long>(lengths[y])*counts[y];
+		}
+
+		size = row*s;
+		if( limit < size ) {
+			size = 0;
+			return 0;
+		}
+
+		features = arg_features;
+		featureLimit = arg_featureLimit;
+		stored.store(0, std::memory_order_relaxed);
+
+		long long n = 0;
+		if( capacity < size ) {
+			values.reset(new std::atomic<double>[size]);
+			capacity = n = size;
+		}
+		for( long long k = 0; k < size; k++ ) {
+			values[k].store(std::numeric_limits<double>::quiet_NaN(), std::memory_order_relaxed);
+		}
+
+		if( features ) {
+			if( begins.size() < size ) {
+				begins.resize(size);
+				ends.resize(size);
+			}
+			std::fill(ends.begin(), ends.begin()+size, -1);
+			if( pools.size() < s*l ) {
+				pools.resize(s*l);
+			}
+			for( int k = 0; k < s*l; k++ ) {
+				pools[k].clear();
+			}
+		}
+		return n;
 	}
 
-	CacheTable createCacheTable(int capacity)
+	//// Workspace ////
+
+	void Workspace::reportStatistics(const std::string& name) const
 	{
-		return std::make_shared<CacheTable_>(capacity, CacheTuple());
+		Logger::out()->debug( "{}: workspace {} allocations ({} bytes) in {} resets", name, allocations, bytes, resets );
 	}
 
+	// カーネルに渡す値を集める作業領域
+	// alpha や V は再帰するので、スレッド毎に再帰の深さ毎の領域を使う
+	struct Lane {
+		std::vector<double> a;
+		std::vector<double> w;
+		std::vector<int> d;
+		std::vector<Label> yd;
+		void push(double av, double wv, int dv, Label ydv) {
+			a.push_back(av);
+			w.push_back(wv);
+			d.push_back(dv);
+			yd.push_back(ydv);
+		}
+		int size() const { return a.size(); }
+
+		// 特殊化したカーネルに渡せるよう項の数を L*M に揃え、揃える前の数を返す
+		int seal(const Kernel::Cell& cell, double a0) {
+			int n = size();
+			if( 0 < cell.labels ) {
+				assert( n <= cell.width() );
+				a.resize(cell.width(), a0);
+				w.resize(cell.width(), -std::numeric_limits<double>::infinity());
+			}
+			return n;
+		}
+	};
+
+	class LaneGuard {
+	public:
+		LaneGuard() {
+			if( lanes.size() <= depth ) {
+				lanes.emplace_back();
+			}
+			lane = &lanes[depth++];
+			lane->a.clear();
+			lane->w.clear();
+			lane->d.clear();
+			lane->yd.clear();
+		}
+		~LaneGuard() { --depth; }
+		Lane* operator->() { return lane; }
+	private:
+		Lane* lane;
+		static thread_local std::deque<Lane> lanes; // 伸ばしても要素は動かない
+		static thread_local int depth;
+	};
+
+	thread_local std::deque<Lane> LaneGuard::lanes;
+	thread_local int LaneGuard::depth{0};
+
 	//// Weights ////
 
 	decltype(std::shared_ptr<Weights>()) createWeights(int dim)
@@ -71,8 +182,33 @@ namespace SemiCrf {
 		mean = JsonIO::readIntDoubleMap(object, "mean");
 		variance = JsonIO::readIntDoubleMap(object, "variance");
 		label_map = JsonIO::readIntIntMap(object, "label_map");
-		auto weight = JsonIO::readDoubleAry(object, "weights");
-		for( auto& w : weight ) push_back(w);
+		// ラベル毎の最大長を持たない重みファイルでは maxLength を使う
+		if( JsonIO::has(object, "label_max_length") ) {
+			label_max_length = JsonIO::readIntIntMap(object, "label_max_length");
+		}
+		if( JsonIO::has(object, "transitions") ) {
+			transitions = JsonIO::readIntIntPairs(object, "transitions");
+		}
+		// ハッシュ素性を使わない重みファイルには無い
+		if( JsonIO::has(object, "hashed_dimension") ) {
+			hashedTemplates = JsonIO::readString(object, "hashed_templates");
+			hashedDim = JsonIO::readInt(object, "hashed_dimension");
+		}
+		// 零の多い重みは (添字,値) の組だけで持つ
+		if( JsonIO::has(object, "sparse_weights") ) {
+			int dim = JsonIO::readInt(object, "weight_dimension");
+			auto weight = JsonIO::readIntDoubleMap(object, "sparse_weights");
+			assign(dim, 0.0);
+			for( auto& w : weight ) {
+				if( w.first < 0 || dim <= w.first ) {
+					throw Error("sparse weight index out of range");
+				}
+				at(w.first) = w.second;
+			}
+		} else {
+			auto weight = JsonIO::readDoubleAry(object, "weights");
+			for( auto& w : weight ) push_back(w);
+		}
 	}
 
 	void Weights::read(std::istream& ifs)
@@ -89,9 +225,24 @@ namespace SemiCrf {
 	{
 		Logger::trace() << "Weights::writeJson()";
 
+		// 非零が半分に満たなければ (添字,値) の組で書く
+		int nnz = std::count_if(begin(), end(), [](double w) { return w != 0.0; });
+		bool sparse = 2*nnz < size();
+
 		ujson::array jweights;
-		for( auto& w : *this ) {
-			jweights.push_back(w);
+		if( sparse ) {
+			for( int k = 0; k < size(); k++ ) {
+				if( at(k) != 0.0 ) {
+					ujson::array jweight;
+					jweight.push_back(k);
+					jweight.push_back(at(k));
+					jweights.push_back(std::move(jweight));
+				}
+			}
+		} else {
+			for( auto& w : *this ) {
+				jweights.push_back(w);
+			}
 		}
 
 		ujson::array jmeans;
@@ -118,6 +269,22 @@ namespace SemiCrf {
 			jlabelMaps.push_back(std::move(jlabelMap));
 		}
 
+		ujson::array jlabelMaxLengths;
+		for( auto& v : label_max_length ) {
+			ujson::array jlabelMaxLength;
+			jlabelMaxLength.push_back(v.first);
+			jlabelMaxLength.push_back(v.second);
+			jlabelMaxLengths.push_back(std::move(jlabelMaxLength));
+		}
+
+		ujson::array jtransitions;
+		for( auto& v : transitions ) {
+			ujson::array jtransition;
+			jtransition.push_back(v.first);
+			jtransition.push_back(v.second);
+			jtransitions.push_back(std::move(jtransition));
+		}
+
 		auto object = ujson::object {
 			{ "title", "Semi-CRF Weights" },
 			{ "dimension", std::move(ujson::array{ xDim, yDim }) },
@@ -129,6 +296,25 @@ namespace SemiCrf {
 			{ "weights", jweights }
 		};
 
+		if( !label_max_length.empty() ) {
+			object.insert(object.end()-1, { "label_max_length", jlabelMaxLengths });
+		}
+
+		if( !transitions.empty() ) {
+			object.insert(object.end()-1, { "transitions", jtransitions });
+		}
+
+		if( 0 < hashedDim ) {
+			object.insert(object.end()-1, { "hashed_templates", hashedTemplates });
+			object.insert(object.end()-1, { "hashed_dimension", hashedDim });
+		}
+
+		if( sparse ) {
+			object.back().first = "sparse_weights";
+			object.insert(object.end()-1, { "weight_dimension", static_cast<int>(size()) });
+			Logger::out()->info( "write {} of {} weights as sparse", nnz, size() );
+		}
+
 		ofs << to_string(object) << std::endl;
 	}
 
@@ -148,6 +334,15 @@ namespace SemiCrf {
 		Logger::trace() << "~FeatureFunction()";
 	}
 
+	void FeatureFunction::setHashedFeature(const std::string&, int dim)
+	{
+		if( 0 < dim ) {
+			std::stringstream ss;
+			ss << "hashed feature not supported: " << feature;
+			throw Error(ss.str());
+		}
+	}
+
 	//// Algorithm ////
 
 	Algorithm::Algorithm(int arg)
@@ -177,6 +372,37 @@ namespace SemiCrf {
 		maxLength = arg;
 	}
 
+	void Algorithm::setLabelMaxLength(const std::map<int,int>& arg)
+	{
+		// 学習データに現れないラベルも長さ 1 のセグメントは取れるようにし、ラティスに経路が残るようにする
+		assert( 0 < maxLength );
+		labelMaxLength.assign(labels->size(), 1);
+		for( auto& p : arg ) {
+			if( 0 <= p.first && p.first < labelMaxLength.size() ) {
+				labelMaxLength[p.first] = std::max(1, std::min(maxLength, p.second));
+			}
+		}
+
+		std::stringstream ss;
+		for( int y = 0; y < labelMaxLength.size(); y++ ) {
+			ss << " " << y << ":" << labelMaxLength[y];
+		}
+		Logger::out()->info( "max length of labels:{}", ss.str() );
+	}
+
+	void Algorithm::setTransitions(const std::set<std::pair<int,int>>& arg)
+	{
+		predecessors.assign(labels->size(), std::vector<Label>());
+		for( auto& p : arg ) {
+			if( 0 <= p.first && p.first < labels->size() && 0 <= p.second && p.second < labels->size() ) {
+				predecessors[p.second].push_back(p.first);
+			}
+		}
+
+		int l = labels->size();
+		Logger::out()->info( "transition constraint: {} of {} transitions allowed", arg.size(), l*l );
+	}
+
 	void Algorithm::setMaxIteration(int arg)
 	{
 		maxIteration = arg;
@@ -192,6 +418,11 @@ namespace SemiCrf {
 		e1 = arg;
 	}
 
+	void Algorithm::setL1(double arg)
+	{
+		l1 = arg;
+	}
+
 	void Algorithm::setRp(double arg)
 	{
 		rp = arg;
@@ -222,39 +453,23 @@ namespace SemiCrf {
 		dim = arg;
 	}
 
-	double Algorithm::computeWG(Label y, Label yd, int i, int d, uvector& gs)
+	// 素性ベクトルを gs に求める、wg は表に記録して alpha、beta、V で使い回す
+	// 素性ベクトルは storeWG が表に記録し、computeG と computeGm は表から読む
+	double Algorithm::computeWG(Label y, Label yd, int i, int d, FeatureVector& gs)
 	{
-		double v = 0.0;
-
-		if( ! (flg & DISABLE_WG_CACHE) ) {
-
-			int l = labels->size();
-			int s = current_data->getStrs()->size();
-			int idx = y*l*s*maxLength + yd*s*maxLength + i*maxLength + d - 1;
-			int p = idx % cacheSize;
-			auto& tp = current_wgtab->at(p);
-
-			if( std::get<0>(tp) == idx && std::get<2>(tp) != nullptr ) {
-
-				v = std::get<1>(tp);
-				gs = *std::get<2>(tp);
-				++hit;
-
-			} else {
-
-				v = ff->wg(*weights, y, yd, *current_data, i-d+1, i, gs);
-				std::get<0>(tp) = idx;
-				std::get<1>(tp) = v;
-				std::get<2>(tp) = std::make_shared<uvector>(gs); // gsをコピーしてshared_ptrを作る
-				++miss;
+		double v = ff->wg(*weights, y, yd, *current_data, i-d+1, i, gs);
+		if( sharedWeights ) {
+			// 共有の重みは他のスレッドが書き換えるので、素性関数には読ませず relaxed で読んで内積を取る
+			v = 0.0;
+			for( const auto& g : gs ) {
+				double w;
+				__atomic_load(&(*sharedWeights)[g.first], &w, __ATOMIC_RELAXED);
+				v += w*g.second;
 			}
-
-		} else {
-
-			v = ff->wg(*weights, y, yd, *current_data, i-d+1, i, gs);
-
 		}
-
+		if( edges.enabled() ) {
+			edges.set(y, yd, i, d, v);
+		}
 		return v;
 	}
 
@@ -267,14 +482,147 @@ namespace SemiCrf {
 			ss << w << ",";
 		}
 		ss << " v: ";
-		int s = weights->size();
-		for( int i = 0; i < s; i++ ) {
-			ss << gs[i];
-			if( i != s-1 ) ss << ",";
+		for( auto it = gs.begin(); it != gs.end(); ++it ) {
+			ss << it->first << ":" << it->second;
+			if( it+1 != gs.end() ) ss << ",";
 		}
 		throw Error(ss.str());
 	}
 
+	// 文毎に wg の表を空にする、最大の文に合わせて確保したものを使い回す
+	// features が真なら、alpha で求めた素性ベクトルも表に持って computeG と computeGm で読む
+	void Algorithm::resetTables(bool features)
+	{
+		int l = labels->size();
+		int s = current_data->getStrs()->size();
+		edgeLengths.resize(l);
+		edgePreds.resize(l);
+		for( auto y : *labels ) {
+			edgeLengths[y] = labelMaxLength.empty() ? maxLength : labelMaxLength[y];
+			edgePreds[y] = &getPredecessors(y);
+		}
+
+		long long limit = ( flg & DISABLE_WG_CACHE ) ? 0 : edgeLimit;
+		long long n = edges.reset(s, edgeLengths, edgePreds, limit, features, featureLimit);
+		if( 0 < n ) {
+			workspace.allocated(n, features ? sizeof(double) + 2*sizeof(int) : sizeof(double));
+		}
+	}
+
+	// ラベル数と最大長が決まった後で、位置毎のカーネルを選ぶ
+	// 特殊化したカーネルが無い組み合わせでは、実行時に選んだ ISA の汎用のカーネルを使う
+	void Algorithm::setupKernel()
+	{
+		// 特殊化したカーネルは exp を要素毎に libm で求めるので、exp もベクトルで求める汎用のカーネルより遅い
+		// 指定された時だけ使う
+		int l = labels->size();
+		if( flg & ENABLE_FIXED_KERNEL ) {
+			cell = &Kernel::selectCell(l, maxLength);
+		} else {
+			cell = &Kernel::genericCell();
+		}
+
+		if( 0 < cell->labels ) {
+			Logger::out()->info( "kernel: fixed (labels {}, max length {})", cell->labels, cell->maxLength );
+		} else {
+			Logger::out()->info( "kernel: {} (labels {}, max length {})", Kernel::getIsa(), l, maxLength );
+		}
+	}
+
+	void Algorithm::setupCandidateSpans(Data& x)
+	{
+		// 長さ candidateMinLength 未満のスパンは常に残るので、経路は必ずある
+		int s = x.getStrs()->size();
+		auto& mask = x.getSpanMask();
+		ff->candidateSpans(x, candidateMinLength, maxLength, mask);
+		x.setSpanMaskStride(maxLength);
+		if( mask.empty() ) {
+			return;
+		}
+
+		for( int i = 0; i < s; i++ ) {
+			for( int d = candidateMinLength; d <= std::min(maxLength, i+1); d++ ) {
+				++spanTotal;
+				if( mask[i*maxLength+d-1] ) {
+					++spanKept;
+				}
+			}
+		}
+	}
+
+	void Algorithm::reportCandidateSpans()
+	{
+		if( 0 < spanTotal ) {
+			Logger::out()->info( "candidate span: kept {} of {} spans of length >= {} ({:.2f}%)",
+				spanKept, spanTotal, candidateMinLength, 100.0*spanKept/spanTotal );
+		}
+	}
+
+	// 位置毎に揃えるためのバリア
+	class Barrier {
+	public:
+		Barrier(int n) : count(n), waiting(0), generation(0) {}
+		void wait() {
+			std::unique_lock<std::mutex> lock(mtx);
+			int gen = generation;
+			if( ++waiting == count ) {
+				waiting = 0;
+				++generation;
+				cv.notify_all();
+			} else {
+				cv.wait(lock, [this, gen]{ return gen != generation; });
+			}
+		}
+	private:
+		std::mutex mtx;
+		std::condition_variable cv;
+		int count;
+		int waiting;
+		int generation;
+	};
+
+	// 位置 begin から step ずつ end の手前まで進め、各位置でラベルを n 個のスレッドに分けて f を呼ぶ
+	// 位置毎にバリアで揃えるので、f は既に求めた位置の値だけを読めばよい
+	// スレッド t は作業領域 works[first+t] を使う、works は呼び出し前に十分な長さにしておく
+	void Algorithm::parallelRows(int n, int first, int begin, int end, int step, const std::function<void(int,Label,FeatureVector&)>& f)
+	{
+		int l = labels->size();
+		Barrier barrier(n);
+		std::mutex mtx;
+		std::exception_ptr error;
+
+		assert( first + n <= works.size() );
+		auto worker = [&](int t) {
+			auto& work = works[first+t];
+			for( int i = begin; i != end; i += step ) {
+				try {
+					for( int y = t; y < l; y += n ) {
+						f(i, y, work);
+					}
+				} catch(...) {
+					std::lock_guard<std::mutex> lock(mtx);
+					if( !error ) {
+						error = std::current_exception();
+					}
+				}
+				barrier.wait(); // 例外が起きても他のスレッドを待たせないよう、バリアには必ず入る
+			}
+		};
+
+		std::vector<std::thread> ts;
+		for( int t = 1; t < n; t++ ) {
+			ts.emplace_back(worker, t);
+		}
+		worker(0);
+		for( auto& t : ts ) {
+			t.join();
+		}
+
+		if( error ) {
+			std::rethrow_exception(error);
+		}
+	}
+
 	//// Learner ////
 
 	decltype( std::make_shared<Algorithm>() ) createLearner(int arg)
@@ -319,6 +667,8 @@ namespace SemiCrf {
 		ff->setYDim(ydim);
 		ff->setMaxLength(maxLength); // maxLengthはdatasをreadした直後に設定されている
 		ff->setLabelMap(datas->getLabelMap());
+		ff->setSpanCacheSize(spanCacheSize);
+		ff->setHashedFeature(hashedTemplates, hashedDim);
 
 		// featureから次元を取得しアルゴリズムに設定
 		dim = ff->getDim();
@@ -335,15 +685,263 @@ namespace SemiCrf {
 			weights->read(ifs); // 重みを初期重みで初期化
 		}
 
-		// 重みにfeatureを設定
+		// 重みにfeature、ハッシュ素性の設定を記録
 		weights->setFeature(feature);
+		weights->setHashedFeature(hashedTemplates, hashedDim);
 
 		// ラベルを生成
 		auto labels = createLabels(ydim);
 		setLabels(labels);
 
-		// 作業領域を初期化
-		gs.resize(dim);
+		// 正解の経路がラティスから外れないよう、学習では観測された最大長で打ち切る
+		setLabelMaxLength(datas->getLabelMaxLength(1.0));
+
+		setupSentenceWeights();
+		if( flg & ENABLE_DEDUPLICATION ) {
+			deduplicate();
+		}
+		setupNoneSampling();
+
+		// 学習データに現れた遷移だけに絞る、正解の経路は必ず残る
+		if( flg & ENABLE_TRANSITION_CONSTRAINT ) {
+			setTransitions(computeTransitions());
+		}
+
+		// 候補スパンは文毎に一度だけ求める、正解のスパンは候補でなくても残し、取りこぼした数を報告する
+		if( flg & ENABLE_CANDIDATE_SPAN ) {
+			int gold = 0;
+			int missed = 0;
+			for( auto& file : *datas ) {
+				for( auto& data : file.second ) {
+					setupCandidateSpans(*data);
+					auto& mask = data->getSpanMask();
+					if( mask.empty() ) {
+						continue;
+					}
+					for( auto& seg : *data->getSegments() ) {
+						int d = seg->getEnd() - seg->getStart() + 1;
+						if( d < candidateMinLength || maxLength < d ) {
+							continue;
+						}
+						++gold;
+						auto& m = mask[seg->getEnd()*maxLength+d-1];
+						if( !m ) {
+							++missed;
+							m = 1;
+						}
+					}
+				}
+			}
+			reportCandidateSpans();
+			if( 0 < gold ) {
+				Logger::out()->info( "candidate span: {} of {} gold spans of length >= {} not generated", missed, gold, candidateMinLength );
+			}
+		}
+
+		setupKernel();
+	}
+
+	// 追加学習で新しいページの文を重くし、古いページの文を間引く、開発用の文を取り分ける
+	// 間引いた古い文は残した割合の逆数で重みを付け、目的関数の期待値を変えない
+	void Learner::setupSentenceWeights()
+	{
+		std::mt19937 rng(shuffleSeed);
+		std::uniform_real_distribution<double> uniform(0.0, 1.0);
+		int nNew = 0;
+		int nOld = 0;
+		int nKept = 0;
+
+		devs.clear();
+		for( int k = 0; k < datas->size(); k++ ) {
+			bool isNew = ( 0 <= oldPages && oldPages <= k );
+			for( auto& data : (*datas)[k].second ) {
+				if( 0.0 < devFraction && uniform(rng) < devFraction ) {
+					data->setWeight(0.0);
+					devs.push_back(data);
+				} else if( isNew ) {
+					data->setWeight(newDataWeight);
+					++nNew;
+				} else if( 0 <= oldPages ) {
+					++nOld;
+					if( uniform(rng) < oldDataFraction ) {
+						data->setWeight(1.0/oldDataFraction);
+						++nKept;
+					} else {
+						data->setWeight(0.0);
+					}
+				}
+			}
+		}
+
+		if( 0 <= oldPages ) {
+			Logger::out()->info( "incremental: {} new sentences with weight {}, {} of {} old sentences kept", nNew, newDataWeight, nKept, nOld );
+		}
+		if( 0.0 < devFraction ) {
+			Logger::out()->info( "dev: {} sentences held out", devs.size() );
+		}
+		devBest = -std::numeric_limits<double>::infinity();
+		devStall = 0;
+	}
+
+	// 字句と正解のセグメントのハッシュ
+	static std::size_t hashSentence(const Data& data)
+	{
+		std::size_t h = 0;
+		auto combine = [&h](std::size_t v) { h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2); };
+		std::hash<std::string> hs;
+		for( auto& row : *data.getStrs() ) {
+			for( auto& s : row ) {
+				combine(hs(s));
+			}
+			combine(row.size());
+		}
+		for( auto& seg : *data.getSegments() ) {
+			combine(seg->getStart());
+			combine(seg->getEnd());
+			combine(seg->getLabel());
+		}
+		return h;
+	}
+
+	static bool isSameSentence(const Data& a, const Data& b)
+	{
+		if( *a.getStrs() != *b.getStrs() ) {
+			return false;
+		}
+		auto sa = a.getSegments();
+		auto sb = b.getSegments();
+		if( sa->size() != sb->size() ) {
+			return false;
+		}
+		for( int k = 0; k < sa->size(); k++ ) {
+			const auto& x = *(*sa)[k];
+			const auto& y = *(*sb)[k];
+			if( x.getStart() != y.getStart() || x.getEnd() != y.getEnd() || x.getLabel() != y.getLabel() ) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// 字句と正解のセグメントが同じ文を最初の 1 つにまとめ、重みを足し合わせる
+	// まとめられた文は重み 0 にして学習で飛ばすので、目的関数は変わらずに forward-backward の回数が減る
+	void Learner::deduplicate()
+	{
+		std::unordered_map<std::size_t, std::vector<Data*>> buckets;
+		int total = 0;
+		int merged = 0;
+
+		for( auto& file : *datas ) {
+			for( auto& data : file.second ) {
+				if( data->getWeight() == 0.0 ) {
+					continue;
+				}
+				++total;
+				auto& bucket = buckets[hashSentence(*data)];
+				auto it = std::find_if(bucket.begin(), bucket.end(), [&data](const Data* d) { return isSameSentence(*d, *data); });
+				if( it != bucket.end() ) {
+					(*it)->setWeight((*it)->getWeight() + data->getWeight());
+					data->setWeight(0.0);
+					++merged;
+				} else {
+					bucket.push_back(data.get());
+				}
+			}
+		}
+
+		Logger::out()->info( "deduplication: {} sentences merged, {} of {} sentences remain", merged, total - merged, total );
+	}
+
+	// 全てのセグメントが NONE (ラベル 0) の文を集め、noneFraction の割合だけ残す
+	// 一括で勾配を求める最適化では種で決めた標本を通して使い、パーセプトロンと SGD では epoch 毎に選び直す
+	void Learner::setupNoneSampling()
+	{
+		nones.clear();
+		noneWeights.clear();
+
+		const auto& label_map = datas->getLabelMap();
+		auto it = label_map.find(0);
+		if( noneFraction == 1.0 || it == label_map.end() ) {
+			return;
+		}
+		Label none = it->second;
+
+		int total = 0;
+		for( auto& file : *datas ) {
+			for( auto& data : file.second ) {
+				if( data->getWeight() == 0.0 ) {
+					continue;
+				}
+				++total;
+				const auto& segments = *data->getSegments();
+				bool all = std::all_of(segments.begin(), segments.end(), [none](const std::shared_ptr<Segment>& seg) { return seg->getLabel() == none; });
+				if( all ) {
+					nones.push_back(data);
+					noneWeights.push_back(data->getWeight());
+				}
+			}
+		}
+
+		std::mt19937 rng(shuffleSeed);
+		int kept = sampleNones(rng);
+		Logger::out()->info( "none sampling: {} of {} all-NONE sentences kept ({} sentences in total)", kept, nones.size(), total );
+	}
+
+	// 残した NONE だけの文は残す割合の逆数で重みを付け、目的関数の期待値を変えない
+	int Learner::sampleNones(std::mt19937& rng)
+	{
+		std::uniform_real_distribution<double> uniform(0.0, 1.0);
+		int kept = 0;
+		for( int k = 0; k < nones.size(); k++ ) {
+			if( uniform(rng) < noneFraction ) {
+				nones[k]->setWeight(noneWeights[k]/noneFraction);
+				++kept;
+			} else {
+				nones[k]->setWeight(0.0);
+			}
+		}
+		return kept;
+	}
+
+	// 重みが正の (学習に使う) 文
+	void Learner::collectSentences(std::vector<decltype(current_data)>& sentences)
+	{
+		sentences.clear();
+		for( auto& file : *datas ) {
+			for( auto& data : file.second ) {
+				if( 0 < data->getStrs()->size() && 0.0 < data->getWeight() ) {
+					sentences.push_back(data);
+				}
+			}
+		}
+	}
+
+	// 取り分けた文の対数尤度を今の重みで求め、devPatience 回続けて相対的に e1 より伸びなければ真
+	bool Learner::isDevPlateau()
+	{
+		if( devs.empty() ) {
+			return false;
+		}
+
+		double L = 0.0;
+		std::vector<double> dL; // 勾配を求めないので使わない
+		for( auto& data : devs ) {
+			double WG = 0.0;
+			double logZ = 0.0;
+			computeSentence(data, dL, false, WG, logZ);
+			L += WG - logZ;
+		}
+
+		// 初回は比べる相手が無い (-inf + inf は NaN になる) ので、伸びたとみなす
+		if( std::isinf(devBest) || devBest + e1*std::abs(devBest) < L ) {
+			devStall = 0;
+		} else {
+			++devStall;
+		}
+		devBest = std::max(devBest, L);
+		Logger::out()->info( "dev: L {} (best {}, {} without improvement)", L, devBest, devStall );
+
+		return devPatience <= devStall;
 	}
 
 	void Learner::postProcess(const std::string& wfile)
@@ -358,6 +956,15 @@ namespace SemiCrf {
 			weights->setMean(datas->getMean());
 			weights->setVariance(datas->getVariance());
 			weights->setLabelMap(datas->getLabelMap());
+			// 推論では quantile で打ち切る、交差検証で l を選んだなら学習と同じ長さを超えない
+			auto ml = datas->getLabelMaxLength(lengthQuantile);
+			for( auto& p : ml ) {
+				if( 0 <= p.first && p.first < labelMaxLength.size() ) {
+					p.second = std::min(p.second, labelMaxLength[p.first]);
+				}
+			}
+			weights->setLabelMaxLength(ml);
+			weights->setTransitions(computeTransitions());
 			weights->write(ofs);
 		}
 	}
@@ -366,13 +973,64 @@ namespace SemiCrf {
 	{
 		Logger::trace() << "Learner::compute()";
 
-		if( !(flg & ENABLE_LIKELIHOOD_ONLY) ){
+		if( 0.0 < l1 && method != "owlqn" ) {
+			throw Error("L1 regularization requires optimizer owlqn");
+		}
+
+		// BFGS は dim*dim の行列を持つので、ハッシュ素性の次元では確保できない
+		if( 0 < hashedDim && method == "bfgs" ) {
+			throw Error("hashed features require an optimizer other than bfgs");
+		}
+
+		if( !(flg & ENABLE_LIKELIHOOD_ONLY) ) {
+
+			if( signal(SIGINT, Signal::handler) == SIG_ERR ) {
+				Logger::warn() << "failed to set signal handler";
+			}
+
+			if( 0 < cvFolds ) {
+				computeCrossValidation();
+			} else {
+				train();
+			}
+
+		} else {
+
+			double L = 0.0;
+			std::vector<double> dL(dim, 0.0);
+			computeGrad(L, dL);
+		}
+
+		// 最後に評価したときの枝刈りの統計
+		if( 0 < beamCells ) {
+			Logger::out()->info( "beam: pruned {:.2f}% of cells, max discarded mass {}", 100.0*beamPruned/beamCells, beamMaxLoss );
+		}
+
+		ff->reportStatistcs();
+	}
+
+	// 設定された手法で重みを学習する
+	void Learner::train()
+	{
+		if( method == "perceptron" || method == "sgd" ) {
+
+			if( method == "perceptron" ) {
+				computePerceptron();
+			} else {
+				computeSgd();
+			}
+
+		} else {
 
 			auto ofunc = createLikelihood(this);
 			Optimizer::UnconstrainedNLP optimizer;
 
 			if( method == "bfgs" ) {
 				optimizer = createBfgs(dim, ofunc);
+			} else if( method == "owlqn" ) {
+				optimizer = createOwlQn(dim, ofunc);
+			} else if( method == "truncated_newton" ) {
+				optimizer = createTruncatedNewton(dim, ofunc);
 			} else if( method == "steepest_decent" ) {
 				optimizer = createSteepestDescent(dim, ofunc);
 			} else {
@@ -381,79 +1039,643 @@ namespace SemiCrf {
 				throw Error(ss.str());
 			}
 
+			if( 0.0 < l1 && !(flg & DISABLE_REGULARIZATION) ) {
+				optimizer->setL1(l1);
+			}
+
 			int f = 0x0;
 			if( !(DISABLE_ADAGRAD & flg) ){
 				f |= Optimizer::ENABLE_ADAGRAD;
 			}
+			if( ENABLE_WOLFE_SEARCH & flg ){
+				f |= Optimizer::ENABLE_WOLFE;
+			}
 
 			optimizer->setFlg(f);
 			optimizer->setE0(e0);
 			optimizer->setRe(e1);
 			optimizer->setAe(e1);
 			optimizer->setMaxIteration(maxIteration);
-
-			if( signal(SIGINT, Signal::handler) == SIG_ERR ) {
-				Logger::warn() << "failed to set signal handler";
+			if( !warmStartFile.empty() ) {
+				optimizer->setWarmStart(warmStartFile);
+			}
+			if( !checkpointFile.empty() ) {
+				optimizer->setCheckpoint(checkpointFile, checkpointIterations, checkpointSeconds);
+				if( resume ) {
+					optimizer->setResume(checkpointFile);
+				}
 			}
 
 			optimizer->optimize();
+		}
+	}
 
-		} else {
+	// 設定 (rp、l1、l) を学習器に当て、sentences のうち正解のセグメントが l に収まる文だけを学習に使う
+	// ラベル毎の最大長を l で打ち切るだけで maxLength は変えないので、候補スパンの表はそのまま使える
+	void Learner::applySetting(const std::map<std::string,double>& setting, const std::vector<decltype(current_data)>& sentences)
+	{
+		int length = maxLength;
+		for( auto& p : setting ) {
+			if( p.first == "rp" ) {
+				rp = p.second;
+			} else if( p.first == "l1" ) {
+				l1 = p.second;
+			} else if( p.first == "l" ) {
+				length = std::min(maxLength, static_cast<int>(p.second));
+			}
+		}
 
-			double L = 0.0;
-			std::vector<double> dL(dim, 0.0);
-			computeGrad(L, dL);
+		auto ml = datas->getLabelMaxLength(1.0);
+		for( auto& p : ml ) {
+			p.second = std::min(p.second, length);
 		}
+
+		// 文の集合は元のデータ集合の属性 (ラベル、平均長など) を写し、ページ 1 つにまとめる
+		auto subset = std::make_shared<TrainingDatas>(*std::static_pointer_cast<TrainingDatas>(datas));
+		subset->clear();
+		subset->emplace_back("cv", std::vector<std::shared_ptr<Data>>());
+		for( auto& data : sentences ) {
+			const auto& segments = *data->getSegments();
+			bool fit = std::all_of(segments.begin(), segments.end(), [length](const std::shared_ptr<Segment>& seg) { return seg->getEnd() - seg->getStart() + 1 <= length; });
+			if( fit ) {
+				subset->back().second.push_back(data);
+			}
+		}
+
+		setLabelMaxLength(ml);
+		datas = subset;
 	}
 
-	void Learner::computeGrad(double& L, std::vector<double>& dL, bool grad)
+	// k 分割交差検証で sweep の設定の組み合わせを全て試し、最も F 値の高い設定で全ての文から学習し直す
+	// 学習器の複製は素性関数 (スパンの素性のキャッシュを含む) と文を共有し、分割と設定の組を threads 個並列に学習する
+	// 評価は jcmp と同じく、正解と予測の NONE 以外のセグメント (始点、終点、ラベル) の集合の再現率と適合率で行う
+	void Learner::computeCrossValidation()
 	{
+		std::vector<decltype(current_data)> sentences;
+		collectSentences(sentences);
+		if( cvFolds < 2 || sentences.size() < cvFolds ) {
+			throw Error("number of folds must be at least 2 and at most the number of sentences");
+		}
+
+		// 文を混ぜてから順に分割へ配る
+		std::mt19937 rng(shuffleSeed);
+		std::shuffle(sentences.begin(), sentences.end(), rng);
+		std::vector<std::vector<decltype(current_data)>> folds(cvFolds);
+		for( int k = 0; k < sentences.size(); k++ ) {
+			folds[k % cvFolds].push_back(sentences[k]);
+		}
+
+		// 設定の組み合わせ
+		std::vector<std::map<std::string,double>> settings(1);
+		for( auto& p : sweep ) {
+			std::vector<std::map<std::string,double>> next;
+			for( auto& s : settings ) {
+				for( auto v : p.second ) {
+					next.push_back(s);
+					next.back()[p.first] = v;
+				}
+			}
+			settings.swap(next);
+		}
+		for( auto& s : settings ) {
+			auto il1 = s.find("l1");
+			if( il1 != s.end() && 0.0 < il1->second && method != "owlqn" ) {
+				throw Error("L1 regularization requires optimizer owlqn");
+			}
+		}
+
+		const auto& label_map = datas->getLabelMap();
+		auto it = label_map.find(0);
+		Label none = ( it != label_map.end() ? it->second : -1 );
+
+		// 分割と設定の組毎に、正解、予測、一致したセグメントの数 (文の重みを掛ける)
+		struct Result {
+			double gold{0.0};
+			double predicted{0.0};
+			double correct{0.0};
+			bool failed{false};
+		};
+		int jobs = settings.size()*cvFolds;
+		std::vector<Result> results(jobs);
+		std::atomic<int> next{0};
+		std::mutex mtx;
+		std::exception_ptr error;
+
+		auto run = [&]() {
+			std::vector<std::tuple<int,int,Label>> path;
+			int job;
+			while( (job = next.fetch_add(1)) < jobs ) {
+				int s = job / cvFolds;
+				int f = job % cvFolds;
+				auto& result = results[job];
+				try {
+					// 複製は重みと文毎の表、作業領域を別に持つ、途中の状態の読み書きはしない
+					Learner learner(*this);
+					learner.current_vctab = createCheckTable(0);
+					learner.current_actab = createCheckTable(0);
+					learner.setParallel(1, parallelMinLength);
+					learner.setWeights(std::make_shared<Weights>(*weights));
+					learner.setCheckpoint("", 0, 0.0, false);
+					learner.setWarmStart("");
+					learner.nones.clear(); // NONE だけの文の重みは書き換えず、今の標本を使う
+					learner.noneWeights.clear();
+
+					std::vector<decltype(current_data)> training;
+					for( int g = 0; g < cvFolds; g++ ) {
+						if( g != f ) {
+							training.insert(training.end(), folds[g].begin(), folds[g].end());
+						}
+					}
+					learner.applySetting(settings[s], training);
+					learner.train();
+
+					for( auto& data : folds[f] ) {
+						learner.current_data = data;
+						learner.resetTables();
+
+						std::set<std::tuple<int,int,Label>> predicted;
+						int maxd = -1;
+						Label maxy;
+						learner.decode(maxy, maxd);
+						if( 0 <= maxd ) {
+							learner.viterbiPath(maxy, path);
+							for( auto& t : path ) {
+								if( std::get<2>(t) != none ) {
+									predicted.insert(t);
+								}
+							}
+						}
+
+						double w = data->getWeight();
+						for( auto& seg : *data->getSegments() ) {
+							if( seg->getLabel() == none ) {
+								continue;
+							}
+							result.gold += w;
+							if( predicted.count(std::make_tuple(seg->getStart(), seg->getEnd(), static_cast<Label>(seg->getLabel()))) ) {
+								result.correct += w;
+							}
+						}
+						result.predicted += w*predicted.size();
+					}
+
+				} catch(Error& e) {
+					Logger::out()->warn( "cv: setting {} fold {} failed: {}", s, f, e.what() );
+					result.failed = true;
+				} catch(...) {
+					std::lock_guard<std::mutex> lock(mtx);
+					if( !error ) {
+						error = std::current_exception();
+					}
+					next = jobs;
+				}
+			}
+		};
+
+		int n = std::max(1, std::min(threads, jobs));
+		std::vector<std::thread> ts;
+		for( int t = 1; t < n; t++ ) {
+			ts.emplace_back(run);
+		}
+		run();
+		for( auto& t : ts ) {
+			t.join();
+		}
+		if( error ) {
+			std::rethrow_exception(error);
+		}
+
+		// 設定毎に分割の数を足し合わせる
+		int best = -1;
+		double bestF = -1.0;
+		for( int s = 0; s < settings.size(); s++ ) {
+			std::stringstream ss;
+			for( auto& p : settings[s] ) {
+				ss << p.first << "=" << p.second << " ";
+			}
+
+			Result sum;
+			for( int f = 0; f < cvFolds; f++ ) {
+				auto& r = results[s*cvFolds + f];
+				sum.gold += r.gold;
+				sum.predicted += r.predicted;
+				sum.correct += r.correct;
+				sum.failed = sum.failed || r.failed;
+			}
+			if( sum.failed ) {
+				Logger::out()->info( "cv: {}failed", ss.str() );
+				continue;
+			}
+
+			double recall = ( 0.0 < sum.gold ? sum.correct/sum.gold : 0.0 );
+			double precision = ( 0.0 < sum.predicted ? sum.correct/sum.predicted : 0.0 );
+			double F = ( 0.0 < recall + precision ? 2.0*recall*precision/(recall + precision) : 0.0 );
+			Logger::out()->info( "cv: {}F: {:4.1f}%, recall: {:4.1f}%, precision: {:4.1f}%", ss.str(), 100.0*F, 100.0*recall, 100.0*precision );
+			if( bestF < F ) {
+				bestF = F;
+				best = s;
+			}
+		}
+		if( best < 0 ) {
+			throw Error("cross validation failed for all settings");
+		}
+
+		std::stringstream ss;
+		for( auto& p : settings[best] ) {
+			ss << p.first << "=" << p.second << " ";
+		}
+		Logger::out()->info( "cv: best {}F: {:4.1f}%", ss.str(), 100.0*bestF );
+
+		// 重み 0 の文 (開発用、間引いた NONE だけの文など) も残し、学習での扱いは変えない
+		std::vector<decltype(current_data)> all;
 		for( auto& file : *datas ) {
+			for( auto& data : file.second ) {
+				if( 0 < data->getStrs()->size() ) {
+					all.push_back(data);
+				}
+			}
+		}
+		applySetting(settings[best], all);
+		train();
+	}
 
-			try {
+	// 平均化構造化パーセプトロン (Collins 2002)、paC が正なら PA-I (Crammer et al. 2006) の歩幅で更新する
+	// 学習文を Viterbi で解き、予測が正解と違えば正解の素性を足して予測の素性を引く
+	// forward-backward も期待値も求めないので、推論と同じ速さで回る
+	void Learner::computePerceptron()
+	{
+		std::vector<decltype(current_data)> sentences;
+		collectSentences(sentences);
+
+		std::mt19937 rng(shuffleSeed);
+		std::vector<double> u(dim, 0.0); // 何番目の文での更新かで重み付けた更新の和、平均は w - u/c
+		long long c = 1;
+		FeatureVector diff;
+		std::vector<std::tuple<int,int,Label>> path;
+
+		// 再開するなら重みと u、c を途中の状態から読む
+		int first = 0;
+		std::vector<double> state;
+		if( readCheckpoint(first, rng, state) ) {
+			c = static_cast<long long>(state.at(0));
+			u.assign(state.begin()+1, state.end());
+		}
 
-				for( auto& data : file.second ) {
+		for( int epoch = first; epoch < epochs; epoch++ ) {
 
-					current_data = data;
-					current_wgtab = createCacheTable(cacheSize);
-					hit = miss = 0;
+			// 順序は毎回元の並びから混ぜるので、乱数の状態だけで再現できる
+			if( !nones.empty() ) {
+				sampleNones(rng);
+				collectSentences(sentences);
+			}
+			auto order = sentences;
+			std::shuffle(order.begin(), order.end(), rng);
+			int errors = 0;
+			int skipped = 0;
 
-					double WG = 0.0;
-					auto Z = computeZ();
-					auto Gs = computeG(WG);
+			for( auto& data : order ) {
 
-					L += WG - log(Z);
+				current_data = data;
+				resetTables();
 
-					if( !(flg & DISABLE_REGULARIZATION) ) {
-						double w2 = 0.0;
-						for( auto& w : *weights ) {
-							w2 += w*w;
+				int maxd = -1;
+				Label maxy;
+				double predV = decode(maxy, maxd);
+				if( maxd < 0 ) {
+					++skipped; // ラティスの制約で経路が無い
+					++c;
+					continue;
+				}
+				viterbiPath(maxy, path);
+
+				// 正解と予測が同じなら更新しない、PA-I の損失は予測に無い正解のセグメントの数
+				auto segments = current_data->getSegments();
+				bool same = ( segments->size() == path.size() );
+				int loss = 0;
+				{
+					std::set<std::tuple<int,int,Label>> predicted(path.begin(), path.end());
+					for( auto& seg : *segments ) {
+						if( !predicted.count(std::make_tuple(seg->getStart(), seg->getEnd(), static_cast<Label>(seg->getLabel()))) ) {
+							++loss;
+							same = false;
 						}
-						w2 *= rp;
-						L -= w2;
 					}
+				}
+				if( same ) {
+					++c;
+					continue;
+				}
+				++errors;
+
+				// 正解の素性を足し、予測の素性を引く
+				diff.clear();
+				double goldV = 0.0;
+				auto y1 = App::ZERO;
+				for( auto& seg : *segments ) {
+					auto y = seg->getLabel();
+					goldV += computeWG(y, y1, seg->getEnd(), seg->getEnd()-seg->getStart()+1, gs);
+					for( const auto& g : gs ) {
+						diff.push_back(g);
+					}
+					y1 = y;
+				}
+				y1 = App::ZERO;
+				for( auto& p : path ) {
+					auto y = std::get<2>(p);
+					computeWG(y, y1, std::get<1>(p), std::get<1>(p)-std::get<0>(p)+1, gs);
+					for( const auto& g : gs ) {
+						diff.emplace_back(g.first, -g.second);
+					}
+					y1 = y;
+				}
 
-					if( flg & ENABLE_LIKELIHOOD_ONLY ) {
-						std::cerr << boost::format("L= %+10.6e WG= %+10.6e logZ= %+10.6e") % L % WG % log(Z) << std::endl;
+				// 同じ素性をまとめる
+				std::sort(diff.begin(), diff.end(), [](const std::pair<int,double>& a, const std::pair<int,double>& b) { return a.first < b.first; });
+				int n = 0;
+				for( int k = 0; k < diff.size(); k++ ) {
+					if( 0 < n && diff[n-1].first == diff[k].first ) {
+						diff[n-1].second += diff[k].second;
+					} else {
+						diff[n++] = diff[k];
 					}
+				}
+				diff.resize(n);
 
-					if( grad ) {
+				double tau = 1.0;
+				if( 0.0 < paC ) {
+					double n2 = 0.0;
+					for( const auto& g : diff ) {
+						n2 += g.second*g.second;
+					}
+					tau = ( 0.0 < n2 ) ? std::min(paC, std::max(0.0, predV - goldV + loss)/n2) : 0.0;
+				}
+				tau *= data->getWeight();
 
-						auto Gms = computeGm(Z);
-						auto idL = dL.begin();
-						auto iw = weights->begin();
-						for( int k = 0; k < dim; k++, idL++, iw++ ) {
-							(*idL) += Gs[k] - Gms[k];
+				for( const auto& g : diff ) {
+					(*weights)[g.first] += tau*g.second;
+					u[g.first] += c*tau*g.second;
+				}
+				++c;
+			}
 
-							if( !(flg & DISABLE_REGULARIZATION) ) {
-								double dw2 = 2.0 * rp * (*iw);
-								(*idL) -= dw2;
-							}
+			Logger::out()->info( "perceptron: epoch {} errors {}/{}", epoch+1, errors, order.size() );
+			if( 0 < skipped ) {
+				Logger::out()->warn( "perceptron: {} sentences without a path in the lattice", skipped );
+			}
+
+			state.assign(1, static_cast<double>(c));
+			state.insert(state.end(), u.begin(), u.end());
+			writeCheckpoint(epoch+1, rng, state, Signal::getFlg());
+
+			if( errors == 0 ) {
+				break;
+			}
+			if( Signal::getFlg() ) {
+				Logger::info() << "interrupt signal received";
+				break;
+			}
+		}
+
+		// 平均化した重みを書く
+		auto iu = u.begin();
+		for( auto& w : *weights ) {
+			w -= (*iu++)/c;
+		}
+	}
+
+	// Hogwild (Niu et al. 2011) の非同期 SGD
+	// スレッド毎に学習器を複製し、文 sgdBatch 個分の勾配を求めては共有の重みに錠をかけずに足す
+	// 他のスレッドの更新と重なると片方が失われることがあるが、素性が疎なら重なりは稀で収束には響かない
+	void Learner::computeSgd()
+	{
+		std::vector<decltype(current_data)> sentences;
+		collectSentences(sentences);
+		auto order = sentences;
+
+		// 複製は重み、素性関数、データを共有し、文毎の表と作業領域だけを別に持つ
+		int n = std::max(1, std::min<int>(threads, order.size()));
+		std::vector<std::unique_ptr<Learner>> workers;
+		std::vector<std::vector<double>> grads(n);
+		for( int t = 0; t < n; t++ ) {
+			workers.emplace_back(new Learner(*this));
+			auto& worker = *workers.back();
+			worker.current_vctab = createCheckTable(0);
+			worker.current_actab = createCheckTable(0);
+			worker.setParallel(1, parallelMinLength); // 文の中では並列にしない
+			worker.sharedWeights = weights;
+			worker.weights = std::make_shared<Weights>(*weights);
+			std::fill(worker.weights->begin(), worker.weights->end(), 0.0); // 素性関数に渡す、読まれるだけの重み
+			worker.marked.assign(dim, 0);
+			grads[t].assign(dim, 0.0);
+		}
+
+		std::mt19937 rng(shuffleSeed);
+		double prevL = 0.0;
 
-							Logger::trace() << "dL(" << k << ")=" << *idL;
+		int first = 0;
+		std::vector<double> state;
+		if( readCheckpoint(first, rng, state) ) {
+			prevL = state.at(0);
+		}
+
+		for( int epoch = first; epoch < epochs; epoch++ ) {
+
+			if( !nones.empty() ) {
+				sampleNones(rng);
+				collectSentences(sentences);
+			}
+			order = sentences;
+			std::shuffle(order.begin(), order.end(), rng);
+			double eta = sgdRate/(1.0 + epoch);
+
+			std::atomic<int> next{0};
+			std::atomic<bool> stop{false};
+			std::vector<double> Ls(n, 0.0); // 更新しながら求めた文毎の対数尤度の和
+			std::mutex mtx;
+			std::exception_ptr error;
+
+			auto run = [&](int t) {
+				auto& worker = *workers[t];
+				auto& dL = grads[t];
+				auto& w = *weights;
+				try {
+					while( !stop && !Signal::getFlg() ) {
+						int begin = next.fetch_add(sgdBatch);
+						if( order.size() <= begin ) {
+							break;
 						}
+						int end = std::min<int>(begin + sgdBatch, order.size());
+						for( int k = begin; k < end; k++ ) {
+							double WG, logZ;
+							Ls[t] += worker.computeSentence(order[k], dL, true, WG, logZ);
+						}
+
+						// 文を解く間に触った添字だけを足して消すので、重みの次元に依らない
+						// 共有の重みの読み書きは computeWG を含めて全て relaxed で、足し算は不可分にしない
+						for( auto k : worker.touched ) {
+							double v;
+							__atomic_load(&w[k], &v, __ATOMIC_RELAXED);
+							v += eta*dL[k];
+							__atomic_store(&w[k], &v, __ATOMIC_RELAXED);
+							dL[k] = 0.0;
+							worker.marked[k] = 0;
+						}
+						worker.touched.clear();
+					}
+				} catch(...) {
+					std::lock_guard<std::mutex> lock(mtx);
+					if( !error ) {
+						error = std::current_exception();
+					}
+					stop = true;
+				}
+			};
+
+			auto start = std::chrono::steady_clock::now();
+			std::vector<std::thread> ts;
+			for( int t = 1; t < n; t++ ) {
+				ts.emplace_back(run, t);
+			}
+			run(0);
+			for( auto& t : ts ) {
+				t.join();
+			}
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+			if( error ) {
+				std::rethrow_exception(error);
+			}
+
+			double L = 0.0;
+			for( auto l : Ls ) {
+				L += l;
+			}
+
+			// L2 正則化は computeGrad と同じくコーパス全体に一度、epoch の終わりに掛ける
+			if( !(flg & DISABLE_REGULARIZATION) ) {
+				double w2 = 0.0;
+				for( auto& w : *weights ) {
+					w2 += w*w;
+					w -= eta*2.0*rp*w;
+				}
+				L -= rp*w2;
+			}
+
+			Logger::out()->info( "sgd: epoch {} L {} ({:.1f} sentences/sec, {} threads)", epoch+1, L, std::min<int>(next, order.size())/elapsed.count(), n );
+
+			// 割り込まれた epoch は途中までの更新を含めて終わったものとする
+			bool converged = ( 0 < epoch && std::abs(L - prevL) <= e1*std::abs(L) );
+			prevL = L;
+			writeCheckpoint(epoch+1, rng, std::vector<double>(1, prevL), Signal::getFlg());
+
+			if( Signal::getFlg() ) {
+				Logger::info() << "interrupt signal received";
+				break;
+			}
+			if( converged || isDevPlateau() ) {
+				break;
+			}
+		}
+
+		// 同期の最適化と比べられるよう、最後の重みで目的関数を求め直す
+		double L = 0.0;
+		std::vector<double> dL; // 勾配を求めないので使わない
+		computeGrad(L, dL, false);
+		Logger::out()->info( "sgd: L {}", L );
+	}
+
+	// パーセプトロンと SGD の epoch 毎の途中の状態を書く
+	// 次に始める epoch、乱数の状態、手法毎の値 state と重みを、一時ファイルに書いてから置き換える
+	void Learner::writeCheckpoint(int epoch, const std::mt19937& rng, const std::vector<double>& state, bool force)
+	{
+		if( checkpointFile.empty() ) {
+			return;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::duration<double> elapsed = now - lastCheckpoint;
+		if( !force
+			&& !( 0 < checkpointIterations && checkpointIterations <= epoch - lastCheckpointEpoch )
+			&& !( 0.0 < checkpointSeconds && checkpointSeconds <= elapsed.count() ) ) {
+			return;
+		}
+
+		writeAtomically(checkpointFile, [&](std::ostream& os) {
+			os.precision(std::numeric_limits<double>::max_digits10);
+			os << method << " " << dim << " " << epoch << std::endl;
+			os << rng << std::endl;
+			os << state.size();
+			for( auto v : state ) {
+				os << " " << v;
+			}
+			os << std::endl;
+			for( auto w : *weights ) {
+				os << w << std::endl;
+			}
+		});
+		lastCheckpoint = now;
+		lastCheckpointEpoch = epoch;
+		Logger::out()->info( "checkpoint: epoch {} written to {}", epoch, checkpointFile );
+	}
+
+	// 再開するなら writeCheckpoint で書いた状態を読み、重みを上書きして真を返す
+	bool Learner::readCheckpoint(int& epoch, std::mt19937& rng, std::vector<double>& state)
+	{
+		lastCheckpoint = std::chrono::steady_clock::now();
+		if( !resume ) {
+			return false;
+		}
+
+		std::ifstream ifs;
+		open(ifs, checkpointFile);
+		std::string m;
+		int n = 0;
+		ifs >> m >> n >> epoch >> rng;
+		if( m != method || n != dim ) {
+			std::stringstream ss;
+			ss << "checkpoint does not match the optimizer or the dimension: " << checkpointFile;
+			throw Error(ss.str());
+		}
+		int k = 0;
+		ifs >> k;
+		state.resize(k);
+		for( auto& v : state ) {
+			ifs >> v;
+		}
+		for( auto& w : *weights ) {
+			ifs >> w;
+		}
+		if( ifs.fail() ) {
+			std::stringstream ss;
+			ss << "cannot read checkpoint: " << checkpointFile;
+			throw Error(ss.str());
+		}
+
+		lastCheckpointEpoch = epoch;
+		Logger::out()->info( "resume from epoch {} of {}", epoch, checkpointFile );
+		return true;
+	}
+
+	void Learner::computeGrad(double& L, std::vector<double>& dL, bool grad)
+	{
+		beamCells = beamPruned = 0;
+		beamMaxLoss = 0.0;
+
+		for( auto& file : *datas ) {
+
+			try {
+
+				for( auto& data : file.second ) {
+					if( data->getWeight() == 0.0 ) {
+						continue;
+					}
+					double WG = 0.0;
+					double logZ = 0.0;
+					L += computeSentence(data, dL, grad, WG, logZ);
+
+					if( flg & ENABLE_LIKELIHOOD_ONLY ) {
+						std::cerr << boost::format("L= %+10.6e WG= %+10.6e logZ= %+10.6e") % L % WG % logZ << std::endl;
 					}
-					Logger::trace() << "cache_hit_rate=" << (double)hit/(double)(miss+hit);
 				}
 
 			} catch(Error& e) {
@@ -462,15 +1684,79 @@ namespace SemiCrf {
 				throw Error(ss.str());
 			}
 		}
+
+		// L2 正則化はコーパス全体に一度だけ掛ける、L1 は OWL-QN が目的関数の外で扱う
+		if( !(flg & DISABLE_REGULARIZATION) ) {
+			double w2 = 0.0;
+			for( auto& w : *weights ) {
+				w2 += w*w;
+			}
+			L -= rp*w2;
+
+			if( grad ) {
+				auto idL = dL.begin();
+				for( auto w : *weights ) {
+					(*idL++) -= 2.0 * rp * w;
+				}
+			}
+		}
+
+		if( 0 < beamCells ) {
+			Logger::out()->debug( "beam: pruned {} of {} cells, max discarded mass {}", beamPruned, beamCells, beamMaxLoss );
+		}
+
+		// 2 回目以降の評価では確保は起きないはず
+		workspace.reportStatistics("computeGrad");
+		workspace.clearStatistics();
 	}
 
-	std::vector<double> Learner::computeG(double& WG)
+	// 文 1 つの対数尤度 WG - logZ に文の重みを掛けて返し、その勾配を dL に足す
+	double Learner::computeSentence(decltype(current_data) data, std::vector<double>& dL, bool grad, double& WG, double& logZ)
+	{
+		current_data = data;
+		sentenceWeight = data->getWeight();
+		resetTables(grad);
+
+		WG = 0.0;
+		auto Z = computeZ(grad);
+
+		if( grad && Logger::getLevel() == 0 ) {
+
+			// トレースでは従来通り、文毎の正解の素性の和 G、期待値 Gm と勾配 dL を全ての次元について出す
+			std::vector<double> G(dim, 0.0);
+			std::vector<double> mGm(dim, 0.0);
+			computeG(WG, G, true);
+			computeGm(Z, mGm);
+			for( int k = 0; k < dim; k++ ) {
+				Logger::trace() << "G(" << k << ")=" << G[k];
+			}
+			for( int k = 0; k < dim; k++ ) {
+				Logger::trace() << "Gm(" << k << ")=" << 0.0 - mGm[k];
+			}
+			for( int k = 0; k < dim; k++ ) {
+				dL[k] += G[k] + mGm[k];
+				Logger::trace() << "dL(" << k << ")=" << dL[k];
+			}
+
+		} else {
+
+			// 正解の素性の和を dL に足し、後で期待値を引く (grad が偽なら WG だけを求める)
+			computeG(WG, dL, grad);
+
+			if( grad ) {
+				computeGm(Z, dL);
+			}
+		}
+
+		logZ = log(Z);
+		return sentenceWeight*(WG - logZ);
+	}
+
+	void Learner::computeG(double& WG, std::vector<double>& dL, bool grad)
 	{
-		std::vector<double> Gs;
 		auto segments = current_data->getSegments();
 		assert( 0 < segments->size() );
 
-		Gs.resize(dim);
 		auto si = segments->begin();
 		auto y1 = App::ZERO;
 		for( ; si != segments->end(); si++ ){
@@ -478,17 +1764,18 @@ namespace SemiCrf {
 			auto y = (*si)->getLabel();
 			int ti = (*si)->getStart();
 			int ui = (*si)->getEnd();
-			WG += computeWG(y, y1, ui, ui-ti+1, gs);
-			int k = 0;
-			for( auto& g : Gs ) {
-				g += gs(k++);
-			}
-			y1 = y;
-		}
-
-		int k = 0;
-		for( auto& g : Gs ) {
-			Logger::trace() << "G(" << k++ << ")=" << g;
+			if( grad ) {
+				const std::pair<int,double>* f;
+				int n;
+				WG += edgeFeatures(y, y1, ui, ui-ti+1, gs, f, n);
+				for( int k = 0; k < n; k++ ) {
+					dL[f[k].first] += sentenceWeight*f[k].second;
+					touch(f[k].first);
+				}
+			} else {
+				WG += edgeWG(y, y1, ui, ui-ti+1, gs);
+			}
+			y1 = y;
 		}
 
 		if( flg & ENABLE_LIKELIHOOD_ONLY ) {
@@ -512,203 +1799,400 @@ namespace SemiCrf {
 				std::cerr << boost::format(" WG= %+10.6e AWG= %+10.6e") % wg % awg << std::endl;
 			}
 		}
+	}
 
-		return(std::move(Gs));
+	std::set<std::pair<int,int>> Learner::computeTransitions()
+	{
+		// computeG と同じく、文頭のセグメントの直前は ZERO とみなす
+		std::set<std::pair<int,int>> transitions;
+		for( auto& file : *datas ) {
+			for( auto& data : file.second ) {
+				auto y1 = App::ZERO;
+				for( auto& seg : *data->getSegments() ) {
+					auto y = seg->getLabel();
+					transitions.insert(std::make_pair(y1, y));
+					y1 = y;
+				}
+			}
+		}
+		return transitions;
 	}
 
-	double Learner::computeZ()
+	// backward が真で文が長ければ、computeGm で使う beta を alpha と並行に求める
+	double Learner::computeZ(bool backward)
 	{
 		double Z = 0;
 
 		int l = labels->size();
 		int s = current_data->getStrs()->size();
-		int capacity = l*s;
-		current_actab = createCheckTable(capacity);
+		workspace.reset(*current_actab, l*s, CheckTuple());
+
+		// 枝刈りしても正解の経路は残す
+		bool beam = 0.0 < beamThreshold && beamMinLength <= s;
+		if( beam ) {
+			workspace.reset(gold, s, -1);
+			for( auto& seg : *current_data->getSegments() ) {
+				gold[seg->getEnd()] = seg->getLabel();
+			}
+		}
+
+		betaTable.clear();
+
+		if( !beam && isParallel(s) ) {
+
+			auto fw = [this](int i, Label y, FeatureVector& work) { alpha(i, y, work); };
+			auto bw = [this, l](int i, Label y, FeatureVector& work) { betaTable[i*l+y] = beta(i, y, work); };
+
+			concurrent = true;
+			try {
+				if( backward ) {
+					// スレッドを前向きと後ろ向きに半分ずつ割り当てる
+					int nb = std::max(1, threads/2);
+					int na = std::max(1, threads-nb);
+					workspace.reset(betaTable, l*s, 0.0);
+					std::exception_ptr error;
+					std::thread tb([&]() {
+						try {
+							parallelRows(nb, na, s-1, -1, -1, bw);
+						} catch(...) {
+							error = std::current_exception();
+						}
+					});
+					try {
+						parallelRows(na, 0, 0, s, 1, fw);
+					} catch(...) {
+						tb.join();
+						throw;
+					}
+					tb.join();
+					if( error ) {
+						std::rethrow_exception(error);
+					}
+				} else {
+					parallelRows(threads, 0, 0, s, 1, fw);
+				}
+			} catch(...) {
+				concurrent = false;
+				betaTable.clear();
+				throw;
+			}
+			concurrent = false;
+
+		} else {
+
+			// 文頭から位置毎に求め、再帰を浅く保つ
+			for( int i = 0; i < s; i++ ) {
+				for( auto y : *labels ) {
+					alpha(i, y, gs);
+				}
+				if( beam ) {
+					prune(i, gold);
+				}
+			}
+		}
 
 		for( auto y : *labels ) {
-			Z += alpha(s-1, y);
+			Z += alpha(s-1, y, gs);
 		}
 
 		Logger::trace() << "Z=" << Z;
 		return Z;
 	}
 
-	std::vector<double> Learner::computeGm(double Z)
+	// 位置 i の alpha のうち、最大値の beamThreshold 倍に満たないものを 0 にする
+	// 0 の alpha を通るセグメントは alpha と computeGm で飛ばすので、以降の位置の計算も減る
+	void Learner::prune(int i, const std::vector<int>& gold)
 	{
-		std::vector<double> Gms;
+		int l = labels->size();
+		double mx = 0.0;
+		double sum = 0.0;
+		for( int y = 0; y < l; y++ ) {
+			double v = std::get<1>(current_actab->at(i*l+y));
+			mx = std::max(mx, v);
+			sum += v;
+		}
 
+		double th = beamThreshold*mx;
+		double lost = 0.0;
+		for( int y = 0; y < l; y++ ) {
+			auto& tp = current_actab->at(i*l+y);
+			++beamCells;
+			if( std::get<1>(tp) < th && gold[i] != y ) {
+				lost += std::get<1>(tp);
+				std::get<1>(tp) = 0.0;
+				++beamPruned;
+			}
+		}
+
+		if( 0.0 < sum ) {
+			beamMaxLoss = std::max(beamMaxLoss, lost/sum);
+		}
+	}
+
+	// 後ろ向きの和 beta を文末から求めながら、各セグメントの周辺確率
+	// alpha(i-d,yd)*exp(wg)*beta(i,y)/Z で素性の期待値を dL から引く
+	// 素性ベクトルの非零要素だけを触るので、計算量は重みの次元に依らない
+	void Learner::computeGm(double Z, std::vector<double>& dL)
+	{
 		int l = labels->size();
 		int s = current_data->getStrs()->size();
-		int capacity = l*s;
 
-		{
-			uvector tmp(dim, 0.0);
-			current_ecvtab = createCheckVTable(capacity);
+		if( !betaTable.empty() ) {
 
-			for( auto y : *labels ) {
-				tmp += *eta(s-1, y);
+			// beta は computeZ で求めてあるので、位置を区切ってスレッド毎に期待値を足し、最後にまとめる
+			int n = std::min(threads, s);
+			if( dLs.size() < n ) {
+				dLs.resize(n);
 			}
+			for( int t = 0; t < n; t++ ) {
+				workspace.reset(dLs[t], dL.size(), 0.0);
+			}
+			std::vector<std::thread> ts;
+			std::mutex mtx;
+			std::exception_ptr error;
+
+			concurrent = true;
+			for( int t = 0; t < n; t++ ) {
+				ts.emplace_back([&, t]() {
+					try {
+						computeGm(s*t/n, s*(t+1)/n, Z, dLs[t], works[t]);
+					} catch(...) {
+						std::lock_guard<std::mutex> lock(mtx);
+						if( !error ) {
+							error = std::current_exception();
+						}
+					}
+				});
+			}
+			for( auto& t : ts ) {
+				t.join();
+			}
+			concurrent = false;
+			betaTable.clear();
 
-			tmp /= Z;
-			for( int k = 0; k < dim; k++ ) {
-				double v = tmp(k);
-				if( std::isinf(v) || std::isnan(v) ) {
-					std::stringstream ss;
-					ss << "numerical problem in " << k << "th component of Gm: " << v;
-					throw Error(ss.str());
+			if( error ) {
+				std::rethrow_exception(error);
+			}
+
+			for( int t = 0; t < n; t++ ) {
+				const auto& v = dLs[t];
+				for( int k = 0; k < dL.size(); k++ ) {
+					if( v[k] != 0.0 ) {
+						dL[k] += v[k];
+						touch(k);
+					}
 				}
-				Gms.push_back(v);
-				Logger::trace() << "Gm(" << k << ")=" << tmp(k);
 			}
+			return;
 		}
 
-		return(std::move(Gms));
-	}
-
-	double Learner::alpha(int i, Label y)
-	{
-		double v = 0;
-
-		if( -1 < i ) {
-
-			int idx = (i*labels->size()) + (static_cast<int>(y));
-			auto& tp = current_actab->at(idx);
+		auto& beta = workspace.reset(betaWork, l*s, 0.0);
 
-			if( std::get<0>(tp) ) {
+		for( auto y : *labels ) {
+			beta[(s-1)*l+y] = 1.0;
+		}
 
-				v = std::get<1>(tp);
+		for( int i = s-1; 0 <= i; i-- ) {
+			for( auto y : *labels ) {
 
-			} else {
+				double b = beta[i*l+y];
+				Logger::trace() << "beta(i=" << i << ",y=" << (int)y << ")=" << b;
+				if( b == 0.0 ) {
+					continue;
+				}
 
-				for( int d = 1; d <= std::min(maxLength, i+1); d++ ) {
-					for( auto yd : *labels ) {
+				for( int d = 1; d <= getMaxLength(y, i); d++ ) {
+					if( !current_data->isCandidateSpan(i, d) ) {
+						continue;
+					}
+					for( auto yd : getPredecessors(y) ) {
 
 						if( i == 0 && yd != App::ZERO ) {
 							continue;
 						}
 
-						auto alp = alpha(i-d, yd);
-						auto wg = computeWG(y, yd, i, d, gs);
-						v += alp*exp(wg);
-						if( std::isinf(v) || std::isnan(v) ) {
+						auto alp = alpha(i-d, yd, gs);
+						if( alp == 0.0 ) {
+							continue; // 枝刈りされたセルを通る経路は無い
+						}
+
+						const std::pair<int,double>* f;
+						int nf;
+						auto wg = edgeFeatures(y, yd, i, d, gs, f, nf);
+						auto ex = exp(wg);
+						if( std::isinf(ex) || std::isnan(ex) ) {
 							exp_numerical_error(wg);
 						}
+
+						double p = alp*ex*b/Z;
+						if( std::isinf(p) || std::isnan(p) ) {
+							std::stringstream ss;
+							ss << "numerical problem in marginal of segment (" << i-d+1 << "," << i << "): " << p;
+							throw Error(ss.str());
+						}
+						for( int k = 0; k < nf; k++ ) {
+							dL[f[k].first] -= sentenceWeight*p*f[k].second;
+							touch(f[k].first);
+						}
+
+						if( 0 < i-d+1 ) {
+							beta[(i-d)*l+yd] += ex*b;
+						}
 					}
 				}
-
-				std::get<0>(tp) = true;
-				std::get<1>(tp) = v;
 			}
-
-		} else if( i == -1 ) {
-
-			v = 1.0;
-
-		} else {
-			throw Error("fatal bug");
 		}
-
-		Logger::trace() << "alpha(i=" << i << ",y=" << (int)y << ")=" << v;
-		return v;
 	}
 
-	double Learner::eta(int i, Label y, int k)
+	// 位置 begin から end の手前までで終わるセグメントの周辺確率で、素性の期待値を dL から引く
+	// alpha と beta は求めてあるものを読むだけなので、位置を分ければ並列に呼べる
+	void Learner::computeGm(int begin, int end, double Z, std::vector<double>& dL, FeatureVector& work)
 	{
-		double v = 0;
-
-		if( -1 < i ) {
-
-			int idx = (i*labels->size()) + (static_cast<int>(y));
-			auto& tp = current_ectab->at(idx);
-
-			if( std::get<0>(tp) ) {
+		int l = labels->size();
 
-				v = std::get<1>(tp);
+		for( int i = begin; i < end; i++ ) {
+			for( auto y : *labels ) {
 
-			} else {
+				double b = betaTable[i*l+y];
+				if( b == 0.0 ) {
+					continue;
+				}
 
-				for( int d = 1; d <= std::min(maxLength, i+1); d++ ) {
-					for( auto yd : *labels ) {
+				for( int d = 1; d <= getMaxLength(y, i); d++ ) {
+					if( !current_data->isCandidateSpan(i, d) ) {
+						continue;
+					}
+					for( auto yd : getPredecessors(y) ) {
 
 						if( i == 0 && yd != App::ZERO ) {
 							continue;
 						}
 
-						double wg = computeWG(y, yd, i, d, gs);
-						double gsk = gs(k); // alphaでもgsを使うので書き変わる前にすぐ保存する
-						double cof = eta(i-d, yd, k) + alpha(i-d, yd) * gsk;
-						v += cof*exp(wg);
-						if( std::isinf(v) || std::isnan(v) ) {
+						auto alp = alpha(i-d, yd, work);
+						if( alp == 0.0 ) {
+							continue;
+						}
+
+						const std::pair<int,double>* f;
+						int nf;
+						auto wg = edgeFeatures(y, yd, i, d, work, f, nf);
+						auto ex = exp(wg);
+						if( std::isinf(ex) || std::isnan(ex) ) {
 							exp_numerical_error(wg);
 						}
+
+						double p = alp*ex*b/Z;
+						if( std::isinf(p) || std::isnan(p) ) {
+							std::stringstream ss;
+							ss << "numerical problem in marginal of segment (" << i-d+1 << "," << i << "): " << p;
+							throw Error(ss.str());
+						}
+						for( int k = 0; k < nf; k++ ) {
+							dL[f[k].first] -= sentenceWeight*p*f[k].second;
+						}
 					}
 				}
+			}
+		}
+	}
 
-				std::get<0>(tp) = true;
-				std::get<1>(tp) = v;
+	// 位置 i で終わるラベル y のセグメントから文末までの和、i より後ろの beta は求めてあるものとする
+	// computeGm の後ろ向きの計算と違い alpha を使わないので、alpha と並行に求められる
+	double Learner::beta(int i, Label y, FeatureVector& work)
+	{
+		int l = labels->size();
+		int s = current_data->getStrs()->size();
+
+		if( i == s-1 ) {
+			return 1.0;
+		}
+
+		LaneGuard lane;
+		for( auto y2 : *labels ) {
+
+			if( !isAllowed(y, y2) ) {
+				continue;
 			}
 
-		} else if( i == -1 ) {
+			for( int d = 1; i+d < s && d <= getMaxLength(y2, i+d); d++ ) {
+				if( !current_data->isCandidateSpan(i+d, d) ) {
+					continue;
+				}
 
-			v = 0.0;
+				double b = betaTable[(i+d)*l+y2];
+				if( b == 0.0 ) {
+					continue;
+				}
 
-		} else {
-			throw Error("fatal bug");
+				lane->push(b, edgeWG(y2, y, i+d, d, work), d, y2);
+			}
+		}
+
+		int n = lane->seal(*cell, 0.0);
+		double v = cell->sumExp(lane->a.data(), lane->w.data(), n);
+		if( std::isinf(v) || std::isnan(v) ) {
+			exp_numerical_error(*std::max_element(lane->w.begin(), lane->w.end()));
 		}
 
-		Logger::trace() << "eta(i=" << i << ",y=" << (int)y << ",k=" << k << ")=" << v;
+		Logger::trace() << "beta(i=" << i << ",y=" << (int)y << ")=" << v;
 		return v;
 	}
 
-	SVector Learner::eta(int i, Label y)
+	double Learner::alpha(int i, Label y, FeatureVector& work)
 	{
-		SVector sv;
+		double v = 0;
 
 		if( -1 < i ) {
 
 			int idx = (i*labels->size()) + (static_cast<int>(y));
-			auto& tp = current_ecvtab->at(idx);
+			auto& tp = current_actab->at(idx);
 
 			if( std::get<0>(tp) ) {
 
-				sv = std::get<1>(tp);
+				v = std::get<1>(tp);
 
 			} else {
 
-				sv = std::make_shared<uvector>(dim, 0.0);
-
-				for( int d = 1; d <= std::min(maxLength, i+1); d++ ) {
-					for( auto yd : *labels ) {
+				// (d,yd) 毎の alpha と wg を集め、カーネルでまとめて足す
+				LaneGuard lane;
+				for( int d = 1; d <= getMaxLength(y, i); d++ ) {
+					if( !current_data->isCandidateSpan(i, d) ) {
+						continue;
+					}
+					for( auto yd : getPredecessors(y) ) {
 
 						if( i == 0 && yd != App::ZERO ) {
 							continue;
 						}
 
-						uvector gs(dim, 0.0); // alphaでもgsを使うのでローカルで領域を確保
-						auto wg = computeWG(y, yd, i, d, gs);
-						uvector cof = (*eta(i-d, yd)) + alpha(i-d, yd) * gs;
-						auto ex = exp(wg);
-						if( std::isinf(ex) || std::isnan(ex) ) {
-							exp_numerical_error(wg);
+						auto alp = alpha(i-d, yd, work);
+						if( alp == 0.0 ) {
+							continue;
 						}
-						(*sv) += cof*ex;
+						lane->push(alp, storeWG(y, yd, i, d, work), d, yd);
 					}
 				}
 
+				int n = lane->seal(*cell, 0.0);
+				v = cell->sumExp(lane->a.data(), lane->w.data(), n);
+				if( std::isinf(v) || std::isnan(v) ) {
+					exp_numerical_error(*std::max_element(lane->w.begin(), lane->w.end()));
+				}
+
 				std::get<0>(tp) = true;
-				std::get<1>(tp) = sv;
+				std::get<1>(tp) = v;
 			}
 
 		} else if( i == -1 ) {
 
-			sv = std::make_shared<uvector>(dim, 0.0);
+			v = 1.0;
 
 		} else {
 			throw Error("fatal bug");
 		}
 
-		Logger::trace() << "eta(i=" << i << ",y=" << (int)y << ")=" << *sv;
-		return sv;
+		Logger::trace() << "alpha(i=" << i << ",y=" << (int)y << ")=" << v;
+		return v;
 	}
 
 	//// Likilihood ////
@@ -735,7 +2219,7 @@ namespace SemiCrf {
 		}
 
 		L = 0.0;
-		std::vector<double> dL(learner->dim);
+		std::vector<double> dL; // 勾配を求めないので使わない
 		learner->computeGrad(L, dL, false);
 
 		return (-L); //
@@ -789,6 +2273,19 @@ namespace SemiCrf {
 	{
 	}
 
+	// 直前に評価した点は受け入れた x とは限らないので、重みを x に揃えてから開発用の文で見る
+	bool Likelihood::isStopped(uvector& x)
+	{
+		if( learner->devs.empty() ) {
+			return false;
+		}
+		int i = 0;
+		for( auto& w : *(learner->weights) ) {
+			w = x[i++];
+		}
+		return learner->isDevPlateau();
+	}
+
 	void Likelihood::postProcess(uvector& x)
 	{
 		int i = 0;
@@ -866,6 +2363,8 @@ namespace SemiCrf {
 		ff->setYDim(ydim);
 		ff->setMaxLength(maxLength);
 		ff->setLabelMap(label_map);
+		ff->setSpanCacheSize(spanCacheSize);
+		ff->setHashedFeature(weights->getHashedTemplates(), weights->getHashedDim()); // ハッシュ素性は学習時の設定に従う
 
 		// featureから次元を取得しアルゴリズムに設定
 		dim = ff->getDim();
@@ -889,8 +2388,17 @@ namespace SemiCrf {
 		auto labels = createLabels(ydim);
 		setLabels(labels);
 
-		// 作業領域を初期化
-		gs.resize(dim);
+		// ラベル毎の最大長は学習時の統計に従う
+		if( !weights->getLabelMaxLength().empty() ) {
+			setLabelMaxLength(weights->getLabelMaxLength());
+		}
+
+		// 学習データに現れた遷移だけを辿る
+		if( !(flg & DISABLE_TRANSITION_CONSTRAINT) && !weights->getTransitions().empty() ) {
+			setTransitions(weights->getTransitions());
+		}
+
+		setupKernel();
 	}
 
 	void Predictor::postProcess(const std::string& wfile)
@@ -908,29 +2416,54 @@ namespace SemiCrf {
 
 				current_data = data;
 
-				int l = labels->size();
 				int s = current_data->getStrs()->size();
 				if( s == 0 ) {
 					continue;
 				}
-				int capacity = l*s;
 
-				current_vctab = createCheckTable(capacity);
-				current_wgtab = createCacheTable(cacheSize);
+				resetTables();
 
-				int maxd = - 1;
-				Label maxy;
-				auto maxV = - std::numeric_limits<double>::max();
+				if( flg & ENABLE_CANDIDATE_SPAN ) {
+					setupCandidateSpans(*current_data);
+				}
 
-				for( auto y : *labels ) {
+				coarseMask.clear();
+				if( flg & ENABLE_COARSE_TO_FINE ) {
+					computeCoarseMask();
+				}
 
+				// 粗い推論で落としたセルが最大値を取りこぼしていないか、全探索と比べる
+				bool check = !coarseMask.empty() && (flg & ENABLE_COARSE_TO_FINE_CHECK);
+				double exactV = 0.0;
+				if( check ) {
+					std::vector<char> tmp;
+					coarseMask.swap(tmp);
 					int d = -1;
-					auto v = V(s-1, y, d);
+					Label y;
+					exactV = decode(y, d);
+					coarseMask.swap(tmp);
+				}
+
+				int maxd = - 1;
+				Label maxy;
+				auto maxV = decode(maxy, maxd);
+
+				if( maxd < 0 ) {
+					// 制約を満たす経路が無ければ、この文だけ制約を外して解き直す
+					Logger::warn() << "no path satisfies the lattice constraints, retry without them";
+					std::vector<std::vector<Label>> tmp0;
+					std::vector<char> tmp1;
+					predecessors.swap(tmp0);
+					coarseMask.swap(tmp1);
+					maxV = decode(maxy, maxd);
+					predecessors.swap(tmp0);
+					coarseMask.swap(tmp1);
+				}
 
-					if( maxV < v ) {
-						maxy = y;
-						maxV = v;
-						maxd = d;
+				if( check ) {
+					++coarseSentences;
+					if( exactV - 1.0e-9*std::max(1.0, std::fabs(exactV)) <= maxV ) {
+						++coarseRecalled;
 					}
 				}
 
@@ -938,14 +2471,134 @@ namespace SemiCrf {
 					std::cerr << boost::format("WG(maxV)= %10.6e") % maxV << std::endl;
 				}
 				assert( 0 < maxd );
-				backtrack(maxy, maxd);
+				backtrack(maxy);
 				printV();
 			}
 		}
+		reportCandidateSpans();
+		if( 0 < coarseCells ) {
+			Logger::out()->info( "coarse-to-fine: kept {:.2f}% of cells", 100.0*coarseKept/coarseCells );
+		}
+		if( 0 < coarseSentences ) {
+			Logger::out()->info( "coarse-to-fine: argmax recall {}/{} ({:.2f}%)", coarseRecalled, coarseSentences, 100.0*coarseRecalled/coarseSentences );
+		}
+
+		workspace.reportStatistics("predict");
+
 		datas->reportStatistcs();
+		ff->reportStatistcs();
+	}
+
+	double Algorithm::decode(Label& maxy, int& maxd)
+	{
+		int l = labels->size();
+		int s = current_data->getStrs()->size();
+		workspace.reset(*current_vctab, l*s, CheckTuple());
+
+		// 長い文では文頭から位置毎に、ラベルを分けて並列に V を埋める
+		if( isParallel(s) ) {
+			concurrent = true;
+			try {
+				parallelRows(threads, 0, 0, s, 1, [this](int i, Label y, FeatureVector& work) {
+					int d = -1;
+					V(i, y, d, work);
+				});
+			} catch(...) {
+				concurrent = false;
+				throw;
+			}
+			concurrent = false;
+		}
+
+		maxd = -1;
+		auto maxV = - std::numeric_limits<double>::max();
+
+		for( auto y : *labels ) {
+
+			int d = -1;
+			auto v = V(s-1, y, d, gs);
+
+			if( 0 < d && maxV < v ) {
+				maxy = y;
+				maxV = v;
+				maxd = d;
+			}
+		}
+
+		return maxV;
+	}
+
+	// 長さ 1 のセグメントだけからなる経路で、各セル (i,y) を通る最大値 (max-marginal) を前向きと後ろ向きに求め、
+	// 全体の最大値から coarseMargin 以内のセルだけを残す
+	// 長さ 1 の wg は表に載るので、続く V の計算でも使い回せる
+	void Predictor::computeCoarseMask()
+	{
+		int l = labels->size();
+		int s = current_data->getStrs()->size();
+		const double inf = std::numeric_limits<double>::infinity();
+		auto& F = workspace.reset(coarseF, l*s, -inf);
+		auto& B = workspace.reset(coarseB, l*s, -inf);
+
+		for( int i = 0; i < s; i++ ) {
+			for( auto y : *labels ) {
+
+				double f = -inf;
+				for( auto yd : getPredecessors(y) ) {
+
+					double v = 0.0;
+					if( i == 0 ) {
+						if( yd != App::ZERO ) {
+							continue;
+						}
+					} else {
+						v = F[(i-1)*l+yd];
+						if( v == -inf ) {
+							continue;
+						}
+					}
+
+					v += edgeWG(y, yd, i, 1, gs);
+					f = std::max(f, v);
+				}
+				F[i*l+y] = f;
+			}
+		}
+
+		for( auto y : *labels ) {
+			B[(s-1)*l+y] = 0.0;
+		}
+
+		for( int i = s-2; 0 <= i; i-- ) {
+			for( auto y : *labels ) {
+
+				double b = B[(i+1)*l+y];
+				if( b == -inf ) {
+					continue;
+				}
+
+				for( auto yd : getPredecessors(y) ) {
+					double v = edgeWG(y, yd, i+1, 1, gs) + b;
+					B[i*l+yd] = std::max(B[i*l+yd], v);
+				}
+			}
+		}
+
+		double maxM = -inf;
+		for( int k = 0; k < l*s; k++ ) {
+			maxM = std::max(maxM, F[k] + B[k]);
+		}
+
+		coarseMask.assign(l*s, 0);
+		for( int k = 0; k < l*s; k++ ) {
+			if( maxM - coarseMargin <= F[k] + B[k] ) {
+				coarseMask[k] = 1;
+				++coarseKept;
+			}
+		}
+		coarseCells += l*s;
 	}
 
-	double Predictor::V(int i, Label y, int& maxd)
+	double Algorithm::V(int i, Label y, int& maxd, FeatureVector& work)
 	{
 		auto maxV = - std::numeric_limits<double>::max();
 
@@ -962,28 +2615,43 @@ namespace SemiCrf {
 			} else {
 
 				maxd = -1;
-				Label maxyd;
+				Label maxyd = App::ZERO;
 
-				for( int d = 1; d <= std::min(maxLength, i+1); d++ ) {
-					for( auto yd : *labels ) {
+				// 粗い推論で落としたセルでは終わらない
+				int maxLen = ( coarseMask.empty() || coarseMask[idx] ) ? getMaxLength(y, i) : 0;
+
+				// (d,yd) 毎の V と wg を集め、カーネルで最大値を求める
+				// 集める順序は d、yd の昇順で、最大となる最初の組を選ぶ
+				LaneGuard lane;
+				for( int d = 1; d <= maxLen; d++ ) {
+					if( !current_data->isCandidateSpan(i, d) ) {
+						continue;
+					}
+					for( auto yd : getPredecessors(y) ) {
 
 						if( i == 0 && yd != App::ZERO ) {
 							continue;
 						}
 
 						int tmp = -1;
-						auto v = V(i-d, yd, tmp);
-						v += computeWG(y, yd, i, d, gs);
-					
-						if( maxV < v ) {
-							maxV = v;
-							maxd = d;
-							maxyd = yd;
+						auto v = V(i-d, yd, tmp, work);
+						if( -1 < i-d && tmp < 0 ) {
+							continue; // 遷移の制約で (i-d,yd) に至る経路が無い
 						}
+						lane->push(v, edgeWG(y, yd, i, d, work), d, yd);
 					}
 				}
 
-				assert( 0 < maxd );
+				int k = -1;
+				int n = lane->seal(*cell, -std::numeric_limits<double>::infinity());
+				auto v = cell->maxAdd(lane->a.data(), lane->w.data(), n, k);
+				if( -1 < k && maxV < v ) {
+					maxV = v;
+					maxd = lane->d[k];
+					maxyd = lane->yd[k];
+				}
+
+				assert( 0 < maxd || !predecessors.empty() || !coarseMask.empty() );
 				std::get<0>(tp) = true;
 				std::get<1>(tp) = maxV;
 				std::get<2>(tp) = maxd;
@@ -1002,27 +2670,21 @@ namespace SemiCrf {
 		return maxV;
 	}
 
-	void Predictor::backtrack(Label maxy, int maxd)
+	// 文末のラベル maxy から V の表を辿り、(始点,終点,ラベル) を文頭から順に path に入れる
+	void Algorithm::viterbiPath(Label maxy, std::vector<std::tuple<int,int,Label>>& path)
 	{
-		Logger::trace() << "Predictor::backtrack()";
-
 		int l = labels->size();
 		int s = current_data->getStrs()->size();
 		int i = s-1;
 		int idx = i*l + (int)maxy;
 		auto& tp0 = current_vctab->at(idx);
-		maxd = std::get<2>(tp0);
+		int maxd = std::get<2>(tp0);
 		auto maxyd = std::get<3>(tp0);
 
-		std::list<decltype(std::make_shared<Segment>())> ls;
-		const auto& reverse_label_map = datas->getReverseLabelMap();
-
+		path.clear();
 		while(1) {
 
-			int label = reverse_label_map[maxy];
-			// 推論では segment に元のラベルが入る
-			auto seg = createSegment(i-maxd+1, i, label);
-			ls.push_front(seg);
+			path.emplace_back(i-maxd+1, i, maxy);
 
 			i -= maxd;
 			if( i < 0 ) {
@@ -1036,6 +2698,24 @@ namespace SemiCrf {
 			maxd = std::get<2>(tp);
 			maxyd = std::get<3>(tp);
 		}
+		std::reverse(path.begin(), path.end());
+	}
+
+	void Predictor::backtrack(Label maxy)
+	{
+		Logger::trace() << "Predictor::backtrack()";
+
+		std::vector<std::tuple<int,int,Label>> path;
+		viterbiPath(maxy, path);
+
+		std::list<decltype(std::make_shared<Segment>())> ls;
+		const auto& reverse_label_map = datas->getReverseLabelMap();
+
+		for( auto& p : path ) {
+			int label = reverse_label_map[std::get<2>(p)];
+			// 推論では segment に元のラベルが入る
+			ls.push_back(createSegment(std::get<0>(p), std::get<1>(p), label));
+		}
 
 		std::string sentence;
 		for( auto s : ls ) {
@@ -3,17 +3,30 @@
 #ifndef SEMI_CRF__H
 #define SEMI_CRF__H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <sstream>
 #include <memory>
+#include <random>
+#include <set>
 #include <string>
 #include <vector>
 #include "FileIO.hpp"
+#include "Kernel.hpp"
 #include "Optimizer.hpp"
 #include "SemiCrfData.hpp"
 
 namespace SemiCrf {
 
+	// 疎な素性ベクトル
+	// 添字と値の組で、同じ添字が複数あれば和をとる
+	using FeatureVector = std::vector<std::pair<int,double>>;
+
 	// 重みベクトル
 	class Weights : public std::vector<double> {
 	protected:
@@ -25,6 +38,10 @@ namespace SemiCrf {
 		std::map<int,double> mean;
 		std::map<int,double> variance;
 		std::map<int,int> label_map;
+		std::map<int,int> label_max_length;
+		std::set<std::pair<int,int>> transitions; // 学習データに現れた (yd,y) の組
+		std::string hashedTemplates{""};
+		int hashedDim{0};
 
 	public:
 
@@ -42,6 +59,9 @@ namespace SemiCrf {
 		void setMean(const std::map<int,double>& arg) { mean = arg; }
 		void setVariance(const std::map<int,double>& arg) { variance = arg; }
 		void setLabelMap(const std::map<int,int>& arg) { label_map = arg; }
+		void setLabelMaxLength(const std::map<int,int>& arg) { label_max_length = arg; }
+		void setTransitions(const std::set<std::pair<int,int>>& arg) { transitions = arg; }
+		void setHashedFeature(const std::string& templates, int dim) { hashedTemplates = templates; hashedDim = dim; }
 		decltype(xDim) getXDim() const { return xDim; }
 		decltype(yDim) getYDim() const { return yDim; }
 		decltype(maxLength) getMaxLength() const { return maxLength; }
@@ -49,6 +69,10 @@ namespace SemiCrf {
 		std::add_const<decltype((variance))>::type getVariance() { return variance; }
 		std::add_const<decltype((feature))>::type getFeature() { return feature; }
 		std::add_const<decltype((label_map))>::type getLabelMap() { return label_map; }
+		std::add_const<decltype((label_max_length))>::type getLabelMaxLength() { return label_max_length; }
+		std::add_const<decltype((transitions))>::type getTransitions() { return transitions; }
+		std::add_const<decltype((hashedTemplates))>::type getHashedTemplates() { return hashedTemplates; }
+		decltype(hashedDim) getHashedDim() const { return hashedDim; }
 	};
 
 	decltype(std::shared_ptr<Weights>()) createWeights(int dim = 0);
@@ -73,6 +97,10 @@ namespace SemiCrf {
 		virtual int getDim() = 0;
 		virtual void setXDim(decltype(xDim) arg) { xDim = arg; }
 		virtual void setYDim(decltype(yDim) arg) { yDim = arg; }
+		virtual void setSpanCacheSize(int) {}
+		virtual void setHashedFeature(const std::string& templates, int dim);
+		virtual void reportStatistcs() {}
+		virtual void candidateSpans(Data&, int, int, std::vector<char>& mask) { mask.clear(); }
 		virtual double wg (
 			Weights& w,
 			Label y,
@@ -80,7 +108,7 @@ namespace SemiCrf {
 			Data& x,
 			int j,
 			int i,
-			uvector& gs	) = 0;
+			FeatureVector& gs	) = 0;
 
 		void setMaxLength(decltype(maxLength) arg) { maxLength = arg; }
 		decltype(maxLength) getMaxLength() const { return maxLength; }
@@ -96,18 +124,129 @@ namespace SemiCrf {
 	using CheckTable = std::shared_ptr<CheckTable_>;
 	CheckTable createCheckTable(int capacity);
 
-	// vector用チェックテーブル
-	using SVector = std::shared_ptr<uvector>;
-	using CheckPair = std::pair<bool,SVector>;
-	using CheckVTable_ = std::vector<CheckPair>;
-	using CheckVTable = std::shared_ptr<CheckVTable_>;
-	CheckVTable createCheckVTable(int capacity);
+	// 文毎のエッジポテンシャル wg(y,yd,i,d) と素性ベクトルの表
+	// ラベル y の最大長までの d と、y の直前に来うる yd の組だけを位置毎に詰めて持ち、まだ求めていないエッジは NaN とする
+	// 並列区間では同じエッジを複数のスレッドが書くことがあるが値は同じなので、wg は relaxed で読み書きする
+	// 素性ベクトルはエッジの終わるセル (i,y) 毎にまとめて持ち、セルの alpha を求めるスレッドだけが書く
+	class EdgeTable {
+	public:
+
+		// 長さ s の文に合わせて全てのエッジを未計算にする、lengths と preds はラベル毎の最大長と直前のラベル
+		// エッジの数が limit を超える文では表を使わず、確保した要素数を返す
+		// features が真なら、素性ベクトルも要素数の合計が featureLimit に達するまで記録する
+		long long reset(int s, const std::vector<int>& lengths, const std::vector<const std::vector<Label>*>& preds, long long limit, bool features, long long featureLimit);
+
+		// 学習器を複製したときは表を共有せず、空の表から始める
+		EdgeTable() = default;
+		EdgeTable(const EdgeTable&) {}
+		EdgeTable& operator=(const EdgeTable&) { return *this; }
+
+		bool enabled() const { return 0 < size; }
+		bool storesFeatures() const { return 0 < size && features; }
+
+		bool get(Label y, Label yd, int i, int d, double& v) const {
+			long long k = index(y, yd, i, d);
+			if( k < 0 ) {
+				return false;
+			}
+			v = values[k].load(std::memory_order_relaxed);
+			return !std::isnan(v);
+		}
+
+		void set(Label y, Label yd, int i, int d, double v) {
+			long long k = index(y, yd, i, d);
+			if( 0 <= k ) {
+				values[k].store(v, std::memory_order_relaxed);
+			}
+		}
+
+		// セル (i,y) の alpha を求めるスレッドから呼ぶ、上限に達していれば記録しない
+		void setFeatures(Label y, Label yd, int i, int d, const FeatureVector& gs) {
+			long long k = index(y, yd, i, d);
+			if( k < 0 || featureLimit < stored.fetch_add(gs.size(), std::memory_order_relaxed) + static_cast<long long>(gs.size()) ) {
+				return;
+			}
+			auto& pool = pools[i*l+y];
+			begins[k] = pool.size();
+			pool.insert(pool.end(), gs.begin(), gs.end());
+			ends[k] = pool.size();
+		}
+
+		// 記録した素性ベクトルを f から n 個とする、alpha を全て求めた後で読む
+		bool getFeatures(Label y, Label yd, int i, int d, const std::pair<int,double>*& f, int& n) const {
+			long long k = index(y, yd, i, d);
+			if( k < 0 || ends[k] < 0 ) {
+				return false;
+			}
+			f = pools[i*l+y].data() + begins[k];
+			n = ends[k] - begins[k];
+			return true;
+		}
+
+	private:
+
+		// 表の形に無いエッジ (学習データに無い遷移、最大長を超える正解のセグメント) では負
+		long long index(Label y, Label yd, int i, int d) const {
+			int k = slots[y*l+yd];
+			if( k < 0 || lengths[y] < d ) {
+				return -1;
+			}
+			return i*row + offsets[y] + (d-1)*counts[y] + k;
+		}
+
+		std::unique_ptr<std::atomic<double>[]> values;
+		std::vector<int> begins; // エッジの素性ベクトルのセルの中での範囲、ends が負なら記録していない
+		std::vector<int> ends;
+		std::vector<FeatureVector> pools; // セル (i,y) 毎の素性ベクトル
+		std::atomic<long long> stored{0};
+		long long featureLimit{0};
+		bool features{false};
+		long long capacity{0};
+		long long size{0};
+		int l{0};
+		long long row{0}; // 位置毎のエッジの数
+		std::vector<int> lengths; // ラベル毎の最大長
+		std::vector<long long> offsets; // ラベル毎の位置の中での先頭
+		std::vector<int> counts; // ラベル毎の直前のラベルの数
+		std::vector<int> slots; // [y*l+yd] は y の直前のラベルの中での yd の順番
+	};
+
+	// 文毎に使い回す DP テーブルと作業領域の確保を数える
+	// 領域は最大の文に合わせて伸ばし、文毎には中身を初期化するだけで確保し直さない
+	class Workspace {
+	public:
+
+		// buf を長さ n、値 v に初期化する、容量が足りないときだけ確保する
+		template <typename T>
+		std::vector<T>& reset(std::vector<T>& buf, int n, const T& v) {
+			count(buf, n);
+			buf.assign(n, v);
+			++resets;
+			return buf;
+		}
 
-	// WGキャッシュ
-	using CacheTuple = std::tuple<int,double,SVector>;
-	using CacheTable_ = std::vector<CacheTuple>;
-	using CacheTable = std::shared_ptr<CacheTable_>;
-	CacheTable createCacheTable(int capacity);
+		// 表の外で確保した n 要素を数える
+		void allocated(long long n, std::size_t size) {
+			++allocations;
+			bytes += n*size;
+		}
+
+		void clearStatistics() { allocations = resets = 0; bytes = 0; }
+		void reportStatistics(const std::string& name) const;
+
+	private:
+
+		template <typename T>
+		void count(const std::vector<T>& buf, int n) {
+			if( buf.capacity() < n ) {
+				allocated(n - buf.capacity(), sizeof(T));
+			}
+		}
+
+		int allocations{0};
+		int resets{0};
+		long long bytes{0};
+	};
 
 	// 抽象アルゴリズム
 	class Algorithm {
@@ -118,25 +257,62 @@ namespace SemiCrf {
 		int y2xDim{-1};
 		int y2yDim{-1};
 		int maxLength{5}; // 最大セグメント長
+		std::vector<int> labelMaxLength; // ラベル毎の最大セグメント長、空なら maxLength
+		double lengthQuantile{1.0};
+		std::vector<std::vector<Label>> predecessors; // ラベル毎に許される直前のラベル、空なら全ラベル
+		double beamThreshold{0.0}; // 位置毎の alpha の最大値に対する枝刈りの閾値、0 なら枝刈りしない
+		int beamMinLength{0}; // 枝刈りする文の最小の長さ
+		double coarseMargin{10.0}; // 粗い推論の最大値からこの幅に入らないセルを落とす
+		int candidateMinLength{4}; // これ以上の長さのスパンを候補に絞る
+		int spanTotal{0}; // 候補の判定をした長いスパンの数
+		int spanKept{0};
+		int threads{1}; // 長い文の中で使うスレッド数
+		int parallelMinLength{512}; // 並列に計算する文の最小の長さ
+		bool concurrent{false}; // 並列区間では作業領域 gs を使わない
+		const Kernel::Cell* cell{&Kernel::genericCell()}; // 位置毎のカーネル、モデルを読んだ後に選ぶ
 		int maxIteration{1024};
 		double e0{1.0e-5};
 		double e1{1.0e-5};
 		double rp{1.0e-7};
+		double l1{0.0}; // L1 正則化の係数、OWL-QN で使う
+		int epochs{10}; // 学習文を一巡する回数の上限、パーセプトロンで使う
+		unsigned int shuffleSeed{0}; // epoch 毎に学習文を混ぜる乱数の種
+		double paC{0.0}; // 正なら passive-aggressive (PA-I) の歩幅の上限
+		double sgdRate{0.1}; // SGD の最初の epoch の学習率、epoch 毎に 1/(1+epoch) で減らす
+		int sgdBatch{10}; // SGD で重みを更新する間に勾配を足す文の数
+		std::string checkpointFile{""}; // 空なら途中の状態を書かない
+		int checkpointIterations{0}; // この反復数 (パーセプトロンと SGD では epoch 数) 毎に書く
+		double checkpointSeconds{0.0}; // この秒数毎に書く
+		bool resume{false}; // checkpointFile から再開する
+		std::string warmStartFile{""}; // 空でなければ前回の途中の状態から曲率の情報だけを読む
+		int oldPages{-1}; // 0 以上なら、これより前のページを前回学習した古いデータとみなす
+		double newDataWeight{1.0}; // 新しいページの文の重み
+		double oldDataFraction{1.0}; // 古いページの文を残す割合
+		double devFraction{0.0}; // 開発用に取り分ける文の割合
+		int devPatience{2}; // 開発用の文の尤度がこの回数続けて伸びなければ止める
+		double noneFraction{1.0}; // 全てのセグメントが NONE の文を学習に残す割合
+		int cvFolds{0}; // 正なら交差検証の分割数
+		std::vector<std::pair<std::string,std::vector<double>>> sweep; // 交差検証で試す (rp、l1、l) の値、組み合わせを全て試す
 		decltype( std::make_shared<Labels>() ) labels{nullptr};
 		decltype( std::shared_ptr<Weights>() ) weights{nullptr};
+		decltype( std::shared_ptr<Weights>() ) sharedWeights{nullptr}; // 非 null なら並列の SGD で共有する重み、wg は relaxed で読んで求める
 		decltype( std::make_shared<FeatureFunction>() ) ff{nullptr};
 		decltype( std::make_shared<Datas>() ) datas{nullptr};
 		decltype( std::make_shared<Data>() ) current_data{nullptr};
-		CheckTable current_vctab{nullptr};
-		CheckTable current_actab{nullptr};
-		CheckTable current_ectab{nullptr};
-		CheckVTable current_ecvtab{nullptr};
-		CacheTable current_wgtab{nullptr};
+		CheckTable current_vctab{createCheckTable(0)};
+		CheckTable current_actab{createCheckTable(0)};
+		EdgeTable edges; // 文毎の wg と素性ベクトルの表
+		long long edgeLimit{1LL << 24}; // これより多くのエッジを持つ文では表を使わない (8 バイト/エッジ、素性ベクトルを持つときは 16 バイト/エッジ)
+		long long featureLimit{1LL << 24}; // 文毎に表に持つ素性ベクトルの要素数の上限 (16 バイト/要素)、超えた分は computeGm で求め直す
+		std::vector<int> edgeLengths; // resetTables で表に渡すラベル毎の最大長と直前のラベル
+		std::vector<const std::vector<Label>*> edgePreds;
+		Workspace workspace; // current_*tab と文毎の作業領域の確保を数える
+		std::vector<FeatureVector> works; // 並列区間でスレッド毎に使う作業領域
 		std::string method{"bfgs"};
-		uvector gs; // 作業領域
-		int cacheSize{0xff};
-		int hit{0};
-		int miss{0};
+		FeatureVector gs; // 作業領域
+		int spanCacheSize{0};
+		std::string hashedTemplates{""};
+		int hashedDim{0};
 
 	public:
 
@@ -154,29 +330,111 @@ namespace SemiCrf {
 
 		virtual void setDimension(decltype(dim) arg);
 		virtual void setMaxLength(int arg);
+		virtual void setLabelMaxLength(const std::map<int,int>& arg);
+		virtual void setTransitions(const std::set<std::pair<int,int>>& arg);
 		virtual void setMaxIteration(int arg);
 		virtual void setE0(double arg);
 		virtual void setE1(double arg);
 		virtual void setRp(double arg);
+		virtual void setL1(double arg);
 		virtual void setMethod(const std::string& arg);
 		virtual void setDatas(decltype(datas) arg);
 		virtual void setLabels(decltype(labels) arg);
 		virtual void setWeights(decltype(weights) arg);
 		virtual void setFeatureFunction(decltype(ff) arg);
 
-		void setCacheSize(decltype(cacheSize) size) { cacheSize = size; }
+		void setSpanCacheSize(decltype(spanCacheSize) size) { spanCacheSize = size; }
+		void setHashedFeature(const std::string& templates, int dim) { hashedTemplates = templates; hashedDim = dim; }
+		void setLengthQuantile(decltype(lengthQuantile) arg) { lengthQuantile = arg; }
+		void setBeam(decltype(beamThreshold) threshold, decltype(beamMinLength) length) { beamThreshold = threshold; beamMinLength = length; }
+		void setCoarseMargin(decltype(coarseMargin) arg) { coarseMargin = arg; }
+		void setCandidateMinLength(decltype(candidateMinLength) arg) { candidateMinLength = arg; }
+		void setEpochs(decltype(epochs) n, decltype(shuffleSeed) seed) { epochs = n; shuffleSeed = seed; }
+		void setPassiveAggressive(decltype(paC) c) { paC = c; }
+		void setSgd(decltype(sgdRate) rate, decltype(sgdBatch) batch) { sgdRate = rate; sgdBatch = batch; }
+		void setCheckpoint(const std::string& file, decltype(checkpointIterations) iterations, decltype(checkpointSeconds) seconds, decltype(resume) arg) {
+			checkpointFile = file; checkpointIterations = iterations; checkpointSeconds = seconds; resume = arg;
+		}
+		void setWarmStart(const std::string& file) { warmStartFile = file; }
+		void setIncremental(decltype(oldPages) pages, decltype(newDataWeight) weight, decltype(oldDataFraction) fraction) {
+			oldPages = pages; newDataWeight = weight; oldDataFraction = fraction;
+		}
+		void setDev(decltype(devFraction) fraction, decltype(devPatience) patience) { devFraction = fraction; devPatience = patience; }
+		void setNoneFraction(decltype(noneFraction) arg) { noneFraction = arg; }
+		void setCrossValidation(decltype(cvFolds) folds, const decltype(sweep)& arg) { cvFolds = folds; sweep = arg; }
+		void setParallel(decltype(threads) n, decltype(parallelMinLength) length) { threads = n; parallelMinLength = length; works.resize(n); }
 		decltype(maxLength) getMaxLength() const { return maxLength; }
 
 	protected:
 
+		// 位置 i で終わるラベル y のセグメントの最大長
+		int getMaxLength(Label y, int i) const {
+			return std::min(labelMaxLength.empty() ? maxLength : labelMaxLength[y], i+1);
+		}
+
+		// ラベル y のセグメントの直前に来うるラベル
+		const std::vector<Label>& getPredecessors(Label y) const {
+			return predecessors.empty() ? *labels : predecessors[y];
+		}
+
 		double computeWG (
 			Label y,
 			Label yd,
 			int i,
 			int d,
-			uvector& gs	);
+			FeatureVector& gs	);
+
+		// 素性ベクトルを使わない呼び出し側のための wg、表にあれば読むだけ
+		double edgeWG(Label y, Label yd, int i, int d, FeatureVector& work) {
+			double v;
+			if( edges.enabled() && edges.get(y, yd, i, d, v) ) {
+				return v;
+			}
+			return computeWG(y, yd, i, d, work);
+		}
+
+		// alpha で求めるエッジの wg、素性ベクトルも表に持つなら、値が表にあっても求めて記録する
+		double storeWG(Label y, Label yd, int i, int d, FeatureVector& work) {
+			if( !edges.storesFeatures() ) {
+				return edgeWG(y, yd, i, d, work);
+			}
+			double v = computeWG(y, yd, i, d, work);
+			edges.setFeatures(y, yd, i, d, work);
+			return v;
+		}
+
+		// 素性ベクトルを f から n 個とする wg、表に無ければ work に求める
+		double edgeFeatures(Label y, Label yd, int i, int d, FeatureVector& work, const std::pair<int,double>*& f, int& n) {
+			double v;
+			if( edges.storesFeatures() && edges.get(y, yd, i, d, v) && edges.getFeatures(y, yd, i, d, f, n) ) {
+				return v;
+			}
+			v = computeWG(y, yd, i, d, work);
+			f = work.data();
+			n = work.size();
+			return v;
+		}
 
 		void exp_numerical_error(double arg);
+		void setupKernel();
+		void resetTables(bool features = false);
+		void setupCandidateSpans(Data& x);
+		void reportCandidateSpans();
+
+		bool isParallel(int s) const { return 1 < threads && parallelMinLength <= s; }
+		bool isAllowed(Label yd, Label y) const {
+			const auto& p = getPredecessors(y);
+			return predecessors.empty() || std::find(p.begin(), p.end(), yd) != p.end();
+		}
+		void parallelRows(int n, int first, int begin, int end, int step, const std::function<void(int,Label,FeatureVector&)>& f);
+
+		// Viterbi、推論とパーセプトロンの学習で使う
+		double V(int i, Label y, int& maxd, FeatureVector& work);
+		double decode(Label& maxy, int& maxd);
+		void viterbiPath(Label maxy, std::vector<std::tuple<int,int,Label>>& path);
+
+		// 長さ 1 のセグメントだけの粗い推論で残した (i,y) のセル、空なら全て
+		std::vector<char> coarseMask;
 	};
 
 	// 学習器
@@ -200,12 +458,62 @@ namespace SemiCrf {
 	private:
 
 		void computeGrad(double& L, std::vector<double>& dL, bool grad=true);
-		double computeZ();
-		std::vector<double> computeG(double& WG);
-		std::vector<double> computeGm(double Z);
-		double alpha(int i, Label y);
-		double eta(int i, Label y, int k);
-		SVector eta(int i, Label y);
+		double computeSentence(decltype(current_data) data, std::vector<double>& dL, bool grad, double& WG, double& logZ);
+		double computeZ(bool backward = false);
+		void computeG(double& WG, std::vector<double>& dL, bool grad);
+		void computeGm(double Z, std::vector<double>& dL);
+		void computeGm(int begin, int end, double Z, std::vector<double>& dL, FeatureVector& work);
+		double alpha(int i, Label y, FeatureVector& work);
+		double beta(int i, Label y, FeatureVector& work);
+		void prune(int i, const std::vector<int>& gold);
+		std::set<std::pair<int,int>> computeTransitions();
+		void computePerceptron();
+		void computeSgd();
+		void train();
+		void computeCrossValidation();
+		void applySetting(const std::map<std::string,double>& setting, const std::vector<decltype(current_data)>& sentences);
+		void writeCheckpoint(int epoch, const std::mt19937& rng, const std::vector<double>& state, bool force);
+		bool readCheckpoint(int& epoch, std::mt19937& rng, std::vector<double>& state);
+		void setupSentenceWeights();
+		void deduplicate();
+		void setupNoneSampling();
+		int sampleNones(std::mt19937& rng);
+		void collectSentences(std::vector<decltype(current_data)>& sentences);
+		bool isDevPlateau();
+
+		// 枝刈りの統計
+		int beamCells{0};
+		int beamPruned{0};
+		double beamMaxLoss{0.0}; // 位置毎に捨てた alpha の割合の最大値
+
+		std::vector<double> betaTable; // computeZ で alpha と並行に求めた beta、空なら computeGm で求める
+		std::vector<double> betaWork; // computeGm で後ろ向きに求める beta
+		std::vector<std::vector<double>> dLs; // computeGm でスレッド毎に足す期待値
+		std::vector<int> gold; // 枝刈りで残す正解のラベル
+		double sentenceWeight{1.0}; // computeG と computeGm で勾配に掛ける文の重み
+
+		// 学習から外して尤度の伸びを見る開発用の文
+		std::vector<decltype(current_data)> devs;
+		double devBest{-std::numeric_limits<double>::infinity()};
+		int devStall{0};
+
+		// SGD の複製で、勾配に足した添字を記録する (marked が空なら記録しない)
+		std::vector<int> touched;
+		std::vector<char> marked;
+		void touch(int k) {
+			if( !marked.empty() && !marked[k] ) {
+				marked[k] = 1;
+				touched.push_back(k);
+			}
+		}
+
+		// 全てのセグメントが NONE の文と、間引く前の重み
+		std::vector<decltype(current_data)> nones;
+		std::vector<double> noneWeights;
+
+		// epoch 毎の途中の状態を最後に書いた時刻と epoch
+		std::chrono::steady_clock::time_point lastCheckpoint;
+		int lastCheckpointEpoch{0};
 	};
 
 	decltype( std::make_shared<Algorithm>() ) createLearner(int arg);
@@ -225,6 +533,7 @@ namespace SemiCrf {
 		virtual void afterUpdateXProcess(uvector& x);
 		virtual void endLoopProcess(uvector& x);
 		virtual void postProcess(uvector& x);
+		virtual bool isStopped(uvector& x);
 
 	private:
 
@@ -252,9 +561,16 @@ namespace SemiCrf {
 
 	private:
 
-		double V(int i, Label y, int& maxd);
-		void backtrack(Label maxy, int maxd);
+		void computeCoarseMask();
+		void backtrack(Label maxy);
 		void printV();
+
+		int coarseCells{0};
+		int coarseKept{0};
+		int coarseSentences{0};
+		int coarseRecalled{0}; // 全探索と同じ最大値に達した文の数
+		std::vector<double> coarseF; // 粗い推論の前向き、後ろ向きの max-marginal
+		std::vector<double> coarseB;
 	};
 
 	decltype( std::make_shared<Algorithm>() ) createPredictor(int arg);
@@ -1,5 +1,7 @@
 // © 2016 PORT INC.
 
+#include <algorithm>
+#include <cmath>
 #include <map>
 #include <set>
 #include "SemiCrfData.hpp"
@@ -103,21 +105,51 @@ namespace SemiCrf {
 	}
 
 	void Data::computeMeanLength(
-		std::map<int,int>* count_,
-		std::map<int,double>* mean_,
-		std::map<int,double>* variance_
-		)
+		std::map<int,int>& count,
+		std::map<int,double>& mean,
+		std::map<int,double>& variance,
+		std::map<std::pair<int,int>,int>& length_histgram
+		) const
 	{
-		count = count_;
-		mean = mean_;
-		variance = variance_;
-
 		for( auto& s : *segs ) {
 			int len = s->getEnd() - s->getStart() + 1;
 			int lb = static_cast<int>(s->getLabel());
-			(*count)[lb] += 1;
-			(*mean)[lb] += len;
-			(*variance)[lb] += len*len;
+			count[lb] += 1;
+			mean[lb] += len;
+			variance[lb] += len*len;
+			length_histgram[std::make_pair(lb,len)] += 1;
+		}
+	}
+
+	void Data::setupHistgram(int xDim)
+	{
+		// 単語IDを一度だけ数値化し、先頭からの出現回数を位置毎に保存する
+		// 区間 [j,i] の単語IDの出現回数は histgram(i+1) - histgram(j) で求まる
+		int s = strs->size();
+		std::vector<int> xvals(s);
+
+		// xDim 以上の単語IDは末尾の列にまとめて数え、表の大きさが単語IDの最大値に依らないようにする
+		histgramDim = xDim + 1;
+		for( int i = 0; i < s; i++ ) {
+
+			int xval = -1;
+			try {
+				xval = boost::lexical_cast<int>(strs->at(i).at(0));
+			} catch(...) {
+				throw Error("invalid word id");
+			}
+			if( xval < 0 ) {
+				throw Error("negative word id");
+			}
+			xvals[i] = std::min(xval, xDim);
+		}
+
+		histgram.assign((s+1)*histgramDim, 0);
+		for( int i = 0; i < s; i++ ) {
+			auto h0 = histgram.begin() + i*histgramDim;
+			auto h1 = h0 + histgramDim;
+			std::copy(h0, h1, h1);
+			h1[xvals[i]]++;
 		}
 	}
 
@@ -125,7 +157,7 @@ namespace SemiCrf {
 	{
 		for( auto& file : *this ) {
 			for( auto& data : file.second ) {
-				data->computeMeanLength(&count, &mean, &variance);
+				data->computeMeanLength(count, mean, variance, length_histgram);
 			}
 		}
 
@@ -137,6 +169,72 @@ namespace SemiCrf {
 			double v = variance[lb]/c;
 			variance[lb] = v - m*m;
 		}
+
+		setupMeanLength();
+	}
+
+	std::map<int,int> Datas::getLabelMaxLength(double quantile) const
+	{
+		// ラベル毎に、セグメントの quantile 以上を覆う最短の長さを求める
+		// length_histgram は (ラベル,長さ) の順に並んでいるので、ラベル毎に長さの昇順で累積する
+		std::map<int,int> ml;
+		for( auto ic : count ) {
+			int lb = ic.first;
+			int n = static_cast<int>(std::ceil(quantile*ic.second));
+			int c = 0;
+			auto it = length_histgram.lower_bound(std::make_pair(lb,0));
+			for( ; it != length_histgram.end() && it->first.first == lb; ++it ) {
+				ml[lb] = it->first.second;
+				c += it->second;
+				if( n <= c ) {
+					break;
+				}
+			}
+		}
+		return ml;
+	}
+
+	void Datas::setupMeanLength()
+	{
+		// wg から map を引かずに済むよう、ラベルで引ける配列にしておく
+		mean_ary.clear();
+		for( auto& m : mean ) {
+			if( mean_ary.size() <= m.first ) {
+				mean_ary.resize(m.first+1, 0.0);
+			}
+			mean_ary[m.first] = m.second;
+		}
+
+		variance_ary.clear();
+		for( auto& v : variance ) {
+			if( variance_ary.size() <= v.first ) {
+				variance_ary.resize(v.first+1, 0.0);
+			}
+			variance_ary[v.first] = v.second;
+		}
+
+		for( auto& file : *this ) {
+			for( auto& data : file.second ) {
+				data->setMeans(&mean_ary);
+				data->setVariancies(&variance_ary);
+			}
+		}
+	}
+
+	void Datas::setupHistgram()
+	{
+		if( !feature.empty() && feature != "DIGIT" ) {
+			return;
+		}
+		if( xDim < 1 ) {
+			return;
+		}
+
+		for( auto& file : *this ) {
+			for( auto& data : file.second ) {
+				data->setupHistgram(xDim);
+			}
+		}
 	}
 
 	void Datas::readJson(std::istream& is)
@@ -486,19 +584,18 @@ namespace SemiCrf {
 
 	void Datas::setMean(const std::map<int ,double>& arg) {
 		mean = arg;
-		for( auto& file : *this ) {
-			for( auto& data : file.second ) {
-				data->setMeans(&mean);
-			}
-		}
+		setupMeanLength();
 	}
 
 	void Datas::setVariance(const std::map<int ,double>& arg) {
 		variance = arg;
-		for( auto& file : *this ) {
-			for( auto& data : file.second ) {
-				data->setVariancies(&variance);
-			}
+		setupMeanLength();
+	}
+
+	void Datas::setXDim(decltype(xDim) arg) {
+		if( xDim != arg ) {
+			xDim = arg;
+			setupHistgram();
 		}
 	}
 
@@ -712,6 +809,8 @@ namespace SemiCrf {
 			throw Error("empty training data");
 		}
 
+		setupHistgram();
+
 		computeMeanLength();
 
 		reportStatistcs();
@@ -780,6 +879,8 @@ namespace SemiCrf {
 		if( empty() ) {
 			throw Error("empty prediction data");
 		}
+
+		setupHistgram();
 	}
 
 	void PredictionDatas::reportStatistcs()
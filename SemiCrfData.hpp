@@ -34,6 +34,14 @@ namespace SemiCrf {
 		, DISABLE_WG_CACHE       = (0x1 << 4)
 		, ENABLE_SIMPLE_PREDICTION_OUTPUT = (0x1 << 5)
 		, ENABLE_DEBUG_PREDICTION_OUTPUT = (0x1 << 6)
+		, ENABLE_TRANSITION_CONSTRAINT = (0x1 << 7)
+		, DISABLE_TRANSITION_CONSTRAINT = (0x1 << 8)
+		, ENABLE_COARSE_TO_FINE = (0x1 << 9)
+		, ENABLE_COARSE_TO_FINE_CHECK = (0x1 << 10)
+		, ENABLE_CANDIDATE_SPAN = (0x1 << 11)
+		, ENABLE_FIXED_KERNEL = (0x1 << 12)
+		, ENABLE_WOLFE_SEARCH = (0x1 << 13)
+		, ENABLE_DEDUPLICATION = (0x1 << 14)
 	};
 
     using uvector = boost::numeric::ublas::vector<double>;
@@ -94,9 +102,13 @@ namespace SemiCrf {
 
 		decltype(std::make_shared<Strs>()) strs{ std::make_shared<Strs>() };
 		decltype(std::make_shared<Segments>()) segs{ std::make_shared<Segments>() };
-		std::map<int,int>* count{ nullptr };
-		std::map<int,double>* mean{ nullptr };
-		std::map<int,double>* variance{ nullptr };
+		const std::vector<double>* mean{ nullptr };
+		const std::vector<double>* variance{ nullptr };
+		std::vector<int> histgram; // 単語IDの累積ヒストグラム (DIGIT)、末尾の列は xDim 以上の単語ID
+		int histgramDim{0};
+		std::vector<char> spanMask; // 候補スパン、[i*spanMaskStride+d-1] が真なら i で終わる長さ d のスパンを使う、空なら全て
+		int spanMaskStride{0};
+		double weight{1.0}; // 学習の目的関数での重み、0 なら学習に使わない
 
 	public:
 
@@ -107,15 +119,24 @@ namespace SemiCrf {
 
 		decltype(strs) getStrs() const { return strs; }
 		decltype(segs) getSegments() const { return segs; }
-		decltype((*mean)[0]) getMean(int lb) { return (*mean)[lb]; }
-		decltype((*variance)[0]) getVariance(int lb) { return (*variance)[lb]; }
+		double getMean(int lb) const { return lb < mean->size() ? (*mean)[lb] : 0.0; }
+		double getVariance(int lb) const { return lb < variance->size() ? (*variance)[lb] : 0.0; }
+		const int* getHistgram(int i) const { return &histgram[i*histgramDim]; }
+		decltype(histgramDim) getHistgramDim() const { return histgramDim; }
+		bool isCandidateSpan(int i, int d) const { return spanMask.empty() || spanMask[i*spanMaskStride+d-1]; }
+		std::vector<char>& getSpanMask() { return spanMask; }
+		void setSpanMaskStride(decltype(spanMaskStride) arg) { spanMaskStride = arg; }
+		decltype(weight) getWeight() const { return weight; }
+		void setWeight(decltype(weight) arg) { weight = arg; }
 		void setSegments(decltype(segs) arg) { segs = arg; }
 		void setMeans(decltype(mean) arg) { mean = arg; }
 		void setVariancies(decltype(variance) arg) { variance = arg; }
 		void computeMeanLength (
-			std::map<int,int>* count,
-			std::map<int,double>* mean,
-			std::map<int,double>* variance );
+			std::map<int,int>& count,
+			std::map<int,double>& mean,
+			std::map<int,double>& variance,
+			std::map<std::pair<int,int>,int>& length_histgram ) const;
+		void setupHistgram(int xDim);
 	};
 
 	// データ集合
@@ -129,6 +150,9 @@ namespace SemiCrf {
 		std::map<int,int> count;
 		std::map<int,double> mean;
 		std::map<int,double> variance;
+		std::vector<double> mean_ary; // ラベル毎の平均長 (mean の配列版)
+		std::vector<double> variance_ary; // ラベル毎の分散 (variance の配列版)
+		std::map<std::pair<int,int>,int> length_histgram; // (ラベル,長さ) 毎のセグメント数
 		std::vector<ujson::value> labels;
 		std::map<int,int> label_map;
 		std::vector<int> reverse_label_map;
@@ -145,11 +169,12 @@ namespace SemiCrf {
 		virtual void writeJson(std::ostream& output) const;
 		virtual void writeSimpleJson(std::ostream& output) const;
 		virtual void writeDebug(std::ostream& output) const;
-		virtual void setXDim(decltype(xDim) arg) { xDim = arg; }
+		virtual void setXDim(decltype(xDim) arg);
 		virtual void setYDim(decltype(yDim) arg) { yDim = arg; }
 		virtual decltype(xDim) getXDim() const { return xDim; }
 		virtual decltype(yDim) getYDim() const { return yDim; }
 		virtual decltype(maxLength) getMaxLength() const { return maxLength; }
+		std::map<int,int> getLabelMaxLength(double quantile) const;
 		virtual void reportStatistcs() = 0;
 
 		void setFeature(const std::string& arg) { feature = arg; }
@@ -172,6 +197,8 @@ namespace SemiCrf {
 		virtual void preReadJsonDataCore(ujson::value& value, Data& data) {};
 		virtual void readJsonDataCore(ujson::value& value, Data& data) = 0;
 		virtual void computeMeanLength();
+		virtual void setupMeanLength();
+		virtual void setupHistgram();
 		virtual std::map<int, std::string> make_labels_map() const;
 		void make_label_word_map(
 				std::shared_ptr<Data> data,
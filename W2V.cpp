@@ -1,8 +1,19 @@
 // © 2016 PORT INC.
 
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <limits>
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "W2V.hpp"
+#include "Kernel.hpp"
 #include "Error.hpp"
 #include "Logger.hpp"
 
@@ -18,74 +29,465 @@ namespace W2V {
 	Matrix_::~Matrix_()
 	{
 		Logger::trace( "~Matrix_()" );
+		unmap();
+	}
+
+	void Matrix_::unmap()
+	{
+		if( base ) {
+			munmap(const_cast<char*>(base), length);
+			base = nullptr;
+			length = 0;
+		}
+	}
+
+	static uint64_t hash(const char* p, size_t len)
+	{
+		// FNV-1a
+		uint64_t h = 14695981039346656037ULL;
+		for( size_t i = 0; i < len; i++ ) {
+			h ^= static_cast<unsigned char>(p[i]);
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	static long long readNumber(const char*& p, const char* end)
+	{
+		while( p < end && (*p == ' ' || *p == '\n' || *p == '\r') ) {
+			++p;
+		}
+		if( p == end || *p < '0' || '9' < *p ) {
+			throw Error("invalid w2v matrix header");
+		}
+		long long n = 0;
+		while( p < end && '0' <= *p && *p <= '9' ) {
+			n = n*10 + (*p++ - '0');
+		}
+		return n;
+	}
+
+	// 量子化形式のヘッダ
+	// 続いて行毎のスケール float[words]、行列本体、改行区切りの単語列が並ぶ
+	struct QuantizedHeader {
+		char magic[4];
+		uint32_t version;
+		uint32_t type;
+		uint32_t reserved;
+		int64_t words;
+		int64_t size;
+	};
+
+	static const char QUANTIZED_MAGIC[4] = { 'W', '2', 'V', 'Q' };
+	static const uint32_t QUANTIZED_VERSION = 1;
+
+	static size_t elementSize(Type type)
+	{
+		switch( type ) {
+		case INT8: return sizeof(int8_t);
+		case FLOAT16: return sizeof(uint16_t);
+		default: return sizeof(float);
+		}
 	}
 
 	void Matrix_::read(const std::string& file)
  	{
-        FILE* f = std::fopen(file.c_str(), "rb");
-   	    if( f == NULL ) {
+		unmap();
+
+		int fd = ::open(file.c_str(), O_RDONLY);
+		if( fd < 0 ) {
 			std::stringstream ss;
 			ss << "cannot open such file: " << file;
 			throw Error(ss.str());
-        }
+		}
+
+		struct stat st;
+		if( fstat(fd, &st) != 0 || st.st_size == 0 ) {
+			::close(fd);
+			std::stringstream ss;
+			ss << "cannot read such file: " << file;
+			throw Error(ss.str());
+		}
+
+		void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		::close(fd);
+		if( p == MAP_FAILED ) {
+			std::stringstream ss;
+			ss << "cannot map such file: " << file;
+			throw Error(ss.str());
+		}
+		base = static_cast<const char*>(p);
+		length = st.st_size;
 
 		Logger::out()->info( "read {}", file );
 
-        //long long words;
-     	fscanf(f, "%lld", &words);
+		if( sizeof(QuantizedHeader) <= length && std::memcmp(base, QUANTIZED_MAGIC, sizeof(QUANTIZED_MAGIC)) == 0 ) {
+			readQuantized(file);
+		} else {
+			readW2V(file);
+		}
 
-        //long long size;
-    	fscanf(f, "%lld", &size);
+		Logger::out()->info( "the number of words: {}", getNumWords() );
+		Logger::out()->info( "dimension: {}", getSize() );
+	}
 
-        M.resize(words);
+	void Matrix_::readW2V(const std::string& file)
+	{
+		const char* q = base;
+		const char* end = base + length;
+		type = FLOAT32;
+		scales = nullptr;
+		words = readNumber(q, end);
+		size = readNumber(q, end);
+		if( std::numeric_limits<int>::max() <= words ) {
+			throw Error("too many words in w2v matrix");
+		}
+
+		word_offsets.resize(words);
+		word_lengths.resize(words);
+		row_offsets.resize(words);
+
+		long long capacity = 16;
+		while( capacity < 2*words ) {
+			capacity <<= 1;
+		}
+		table.assign(capacity, 0);
 
-        char c;
 		for( long long i = 0; i < words; i++ ) {
 
-            std::string w;
+			// 単語の前の改行は読み飛ばす
+			while( q < end && *q == '\n' ) {
+				++q;
+			}
 
-            while(1) {
-                c = std::fgetc(f);
-                if( c == '\n' ) {
-                    continue;
-                } else if( std::feof(f) || c == ' ' ) {
-                    w2i_[w] = i;
-                    i2w_[i] = w;
-		 			break;
-		 		}
-		 		w.push_back(c);
-		 	}
+			const char* w = q;
+			while( q < end && *q != ' ' ) {
+				++q;
+			}
+			size_t len = q - w;
+			++q; // 空白
 
-            vector& v = M[i];
-			v.resize(size);
-		 	for( long long j = 0; j < size; j++ ) {
-		 		float e;
-                std::fread((char*)&e, sizeof(float), 1, f);
-		 		v(j) = e;
-		 	}
+			if( end < q + size*sizeof(float) ) {
+				std::stringstream ss;
+				ss << file << ": truncated w2v matrix";
+				throw Error(ss.str());
+			}
 
-		 	// double n = norm_2(v);
-		 	// v = v/n;
+			row_offsets[i] = q - base;
+			q += size*sizeof(float);
+			index(i, w, len);
 		}
+	}
 
-        std::fclose(f);
+	void Matrix_::readQuantized(const std::string& file)
+	{
+		QuantizedHeader header;
+		std::memcpy(&header, base, sizeof(header));
+		if( header.version != QUANTIZED_VERSION ) {
+			std::stringstream ss;
+			ss << file << ": unsupported quantized matrix version " << header.version;
+			throw Error(ss.str());
+		}
+		if( header.type != INT8 && header.type != FLOAT16 ) {
+			std::stringstream ss;
+			ss << file << ": unsupported quantized matrix type " << header.type;
+			throw Error(ss.str());
+		}
 
-		Logger::out()->info( "the number of words: {}", getNumWords() );
-		Logger::out()->info( "dimension: {}", getSize() );
+		type = static_cast<Type>(header.type);
+		words = header.words;
+		size = header.size;
+		if( words < 0 || size < 0 || std::numeric_limits<int>::max() <= words ) {
+			throw Error("invalid quantized matrix header");
+		}
+
+		size_t es = elementSize(type);
+		size_t rows = sizeof(QuantizedHeader) + words*sizeof(float);
+		size_t strs = rows + words*size*es;
+		if( length < strs ) {
+			std::stringstream ss;
+			ss << file << ": truncated quantized matrix";
+			throw Error(ss.str());
+		}
+		scales = reinterpret_cast<const float*>(base + sizeof(QuantizedHeader));
+
+		word_offsets.resize(words);
+		word_lengths.resize(words);
+		row_offsets.resize(words);
+
+		long long capacity = 16;
+		while( capacity < 2*words ) {
+			capacity <<= 1;
+		}
+		table.assign(capacity, 0);
+
+		const char* q = base + strs;
+		const char* end = base + length;
+		for( long long i = 0; i < words; i++ ) {
+
+			const char* w = q;
+			while( q < end && *q != '\n' ) {
+				++q;
+			}
+			if( q == end ) {
+				std::stringstream ss;
+				ss << file << ": truncated quantized matrix";
+				throw Error(ss.str());
+			}
+			size_t len = q - w;
+			++q; // 改行
+
+			row_offsets[i] = rows + i*size*es;
+			index(i, w, len);
+		}
+	}
+
+	void Matrix_::index(long long i, const char* w, size_t len)
+	{
+		word_offsets[i] = w - base;
+		word_lengths[i] = len;
+
+		// 同じ単語が複数あれば後のものを使う
+		uint64_t mask = table.size() - 1;
+		uint64_t k = hash(w, len) & mask;
+		while( table[k] ) {
+			long long j = table[k] - 1;
+			if( word_lengths[j] == len && std::memcmp(base + word_offsets[j], w, len) == 0 ) {
+				break;
+			}
+			k = (k + 1) & mask;
+		}
+		table[k] = i + 1;
+	}
+
+	void Matrix_::write(const std::string& file, Type t)
+	{
+		if( t != INT8 && t != FLOAT16 ) {
+			throw Error("unsupported quantized matrix type");
+		}
+		if( words < 0 ) {
+			throw Error("no matrix to write");
+		}
+
+		std::ofstream ofs(file, std::ios::binary);
+		if( ofs.fail() ) {
+			std::stringstream ss;
+			ss << "cannot open such file: " << file;
+			throw Error(ss.str());
+		}
+
+		QuantizedHeader header;
+		std::memcpy(header.magic, QUANTIZED_MAGIC, sizeof(QUANTIZED_MAGIC));
+		header.version = QUANTIZED_VERSION;
+		header.type = t;
+		header.reserved = 0;
+		header.words = words;
+		header.size = size;
+		ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+		// 行毎のスケールは行の絶対値の最大値から決める
+		std::vector<double> v(size);
+		std::vector<float> ss(words);
+		for( long long i = 0; i < words; i++ ) {
+			std::fill(v.begin(), v.end(), 0.0);
+			add(i, v.data());
+			double m = 0.0;
+			for( auto e : v ) {
+				m = std::max(m, std::fabs(e));
+			}
+			if( m == 0.0 ) {
+				m = 1.0;
+			}
+			ss[i] = ( t == INT8 ) ? m/127.0 : m;
+		}
+		ofs.write(reinterpret_cast<const char*>(ss.data()), words*sizeof(float));
+
+		std::vector<int8_t> q8(size);
+		std::vector<uint16_t> q16(size);
+		for( long long i = 0; i < words; i++ ) {
+			std::fill(v.begin(), v.end(), 0.0);
+			add(i, v.data());
+			if( t == INT8 ) {
+				for( long long k = 0; k < size; k++ ) {
+					double e = std::round(v[k]/ss[i]);
+					q8[k] = static_cast<int8_t>(std::max(-127.0, std::min(127.0, e)));
+				}
+				ofs.write(reinterpret_cast<const char*>(q8.data()), size*sizeof(int8_t));
+			} else {
+				for( long long k = 0; k < size; k++ ) {
+					q16[k] = float2half(v[k]/ss[i]);
+				}
+				ofs.write(reinterpret_cast<const char*>(q16.data()), size*sizeof(uint16_t));
+			}
+		}
+
+		for( long long i = 0; i < words; i++ ) {
+			ofs.write(base + word_offsets[i], word_lengths[i]);
+			ofs.put('\n');
+		}
+
+		if( ofs.fail() ) {
+			std::stringstream ss;
+			ss << "cannot write such file: " << file;
+			throw Error(ss.str());
+		}
+	}
+
+	long long Matrix_::find(const char* w, size_t len)
+	{
+		if( table.empty() ) {
+			return -1;
+		}
+
+		uint64_t mask = table.size() - 1;
+		uint64_t k = hash(w, len) & mask;
+		while( table[k] ) {
+			long long j = table[k] - 1;
+			if( word_lengths[j] == len && std::memcmp(base + word_offsets[j], w, len) == 0 ) {
+				return j;
+			}
+			k = (k + 1) & mask;
+		}
+
+		return -1;
 	}
 
 	long long Matrix_::w2i(const std::string& w)
 	{
-		long long ret = -1;
-        auto ip = w2i_.find(w);
-        if( ip != w2i_.end() ) {
-            ret = ip->second;
-        }
-		return ret;
+		return find(w.data(), w.size());
+	}
+
+	const float* Matrix_::i2v(long long i)
+	{
+		if( i < 0 || words <= i ) {
+			throw Error("word index out of range");
+		}
+		if( type != FLOAT32 ) {
+			throw Error("float vector not available in quantized matrix");
+		}
+		return reinterpret_cast<const float*>(base + row_offsets[i]);
+	}
+
+	void Matrix_::add(long long i, double* acc)
+	{
+		if( i < 0 || words <= i ) {
+			throw Error("word index out of range");
+		}
+
+		const char* row = base + row_offsets[i];
+		switch( type ) {
+		case INT8:
+			W2V::add(reinterpret_cast<const int8_t*>(row), scales[i], acc, size);
+			break;
+		case FLOAT16:
+			W2V::add(reinterpret_cast<const uint16_t*>(row), scales[i], acc, size);
+			break;
+		default:
+			W2V::add(reinterpret_cast<const float*>(row), acc, size);
+			break;
+		}
+	}
+
+	double Matrix_::dot(long long i, const double* w)
+	{
+		if( i < 0 || words <= i ) {
+			throw Error("word index out of range");
+		}
+
+		const char* row = base + row_offsets[i];
+		switch( type ) {
+		case INT8:
+			return W2V::dot(reinterpret_cast<const int8_t*>(row), scales[i], w, size);
+		case FLOAT16:
+			return W2V::dot(reinterpret_cast<const uint16_t*>(row), scales[i], w, size);
+		default:
+			return W2V::dot(reinterpret_cast<const float*>(row), w, size);
+		}
+	}
+
+	//// kernels ////
+
+	// カーネルは Kernel が実行時に選んだ実装を使う
+
+	void add(const float* v, double* acc, long long n)
+	{
+		Kernel::addF32(v, acc, n);
+	}
+
+	double dot(const double* a, const double* b, long long n)
+	{
+		return Kernel::dotF64(a, b, n);
+	}
+
+	double dot(const float* v, const double* b, long long n)
+	{
+		return Kernel::dotF32(v, b, n);
+	}
+
+	void add(const int8_t* v, float scale, double* acc, long long n)
+	{
+		Kernel::addI8(v, scale, acc, n);
+	}
+
+	double dot(const int8_t* v, float scale, const double* b, long long n)
+	{
+		return Kernel::dotI8(v, scale, b, n);
+	}
+
+	void add(const uint16_t* v, float scale, double* acc, long long n)
+	{
+		Kernel::addF16(v, scale, acc, n);
+	}
+
+	double dot(const uint16_t* v, float scale, const double* b, long long n)
+	{
+		return Kernel::dotF16(v, scale, b, n);
+	}
+
+	uint16_t float2half(float f)
+	{
+		uint32_t x;
+		std::memcpy(&x, &f, sizeof(x));
+
+		uint16_t sign = (x >> 16) & 0x8000;
+		int32_t e = static_cast<int32_t>((x >> 23) & 0xff);
+		uint32_t m = x & 0x7fffff;
+
+		if( e == 0xff ) { // inf, nan
+			return sign | 0x7c00 | ( m ? 0x200 : 0 );
+		}
+
+		e = e - 127 + 15;
+		if( 31 <= e ) { // オーバーフロー
+			return sign | 0x7c00;
+		}
+
+		if( e <= 0 ) { // 非正規化数
+			if( e < -10 ) {
+				return sign;
+			}
+			m |= 0x800000;
+			int shift = 14 - e;
+			uint32_t h = m >> shift;
+			uint32_t rem = m & ((1u << shift) - 1);
+			uint32_t half = 1u << (shift - 1);
+			if( half < rem || (rem == half && (h & 1)) ) {
+				h++;
+			}
+			return sign | h;
+		}
+
+		// 最近接偶数丸め、繰り上がりは指数部に伝搬する
+		uint32_t h = (e << 10) | (m >> 13);
+		uint32_t rem = m & 0x1fff;
+		if( 0x1000 < rem || (rem == 0x1000 && (h & 1)) ) {
+			h++;
+		}
+		return sign | h;
 	}
 
-	const vector& Matrix_::i2v(int i)
+	float half2float(uint16_t h)
 	{
-		return M.at(i);
+		return Kernel::halfToFloat(h);
 	}
 }
@@ -3,9 +3,11 @@
 #ifndef W2V__H
 #define W2V__H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include <boost/numeric/ublas/vector.hpp>
 
 namespace W2V {
@@ -13,24 +15,65 @@ namespace W2V {
     using namespace boost::numeric::ublas;
     typedef boost::numeric::ublas::vector<double> vector;
 
+	// 行列の要素の型
+	enum Type {
+		FLOAT32   = 0 // word2vec バイナリ形式
+		, INT8    = 1 // 量子化形式 (行毎のスケール付き)
+		, FLOAT16 = 2 // 量子化形式 (行毎のスケール付き)
+	};
+
+	// word2vec バイナリ形式または量子化形式の行列
+	// ファイルをメモリマップし、格納された型のまま参照する
  	class Matrix_ {
 	public:
 		Matrix_();
         virtual ~Matrix_();
+		Matrix_(const Matrix_&) = delete; // マップを二重に解放しないよう複製させない
+		Matrix_& operator=(const Matrix_&) = delete;
 		void read(const std::string& file);
+		void write(const std::string& file, Type type);
 		long long w2i(const std::string& w);
-		const vector& i2v(int i);
+		const float* i2v(long long i);
+		void add(long long i, double* acc);
+		double dot(long long i, const double* w);
 		long long getNumWords() { return words; }
 		long long getSize() { return size; }
+		Type getType() { return type; }
+    private:
+		void unmap();
+		void readW2V(const std::string& file);
+		void readQuantized(const std::string& file);
+		void index(long long i, const char* w, size_t len);
+		long long find(const char* w, size_t len);
     private:
 		long long words;
 		long long size;
-        std::map<std::string, long long> w2i_;
-        std::map<long long, std::string> i2w_;
-        std::vector<vector> M;
+		Type type{FLOAT32};
+		const char* base{nullptr}; // マップした先頭
+		size_t length{0};
+		const float* scales{nullptr}; // 行毎のスケール (量子化形式)
+		std::vector<long long> word_offsets; // 各単語の先頭
+		std::vector<int> word_lengths; // 各単語の長さ
+		std::vector<long long> row_offsets; // 各単語のベクトルの先頭
+		std::vector<int> table; // オープンアドレス法のハッシュ表 (単語番号+1, 0は空)
 	};
 
 	typedef std::shared_ptr<Matrix_> Matrix;
+
+	// acc += v (v は float のベクトル、境界は揃っていなくてもよい)
+	void add(const float* v, double* acc, long long n);
+	void add(const int8_t* v, float scale, double* acc, long long n);
+	void add(const uint16_t* v, float scale, double* acc, long long n);
+
+	// a・b
+	double dot(const double* a, const double* b, long long n);
+	double dot(const float* v, const double* b, long long n);
+	double dot(const int8_t* v, float scale, const double* b, long long n);
+	double dot(const uint16_t* v, float scale, const double* b, long long n);
+
+	// 半精度浮動小数点数の変換
+	uint16_t float2half(float f);
+	float half2float(uint16_t h);
 }
 
 #endif // W2V__H
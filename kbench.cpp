@@ -0,0 +1,180 @@
+// © 2016 PORT INC.
+
+#include <iostream>
+#include <sstream>
+#include <cmath>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <boost/lexical_cast.hpp>
+#include "Logger.hpp"
+#include "Error.hpp"
+#include "Kernel.hpp"
+
+class Options {
+public:
+	Options()
+		: repeat(200000)
+		, sizes{7, 16, 64, 112, 256}
+		, logLevel(2)
+		, logColor(false)
+		, logPattern("")
+		{};
+	void parse(int argc, char *argv[]);
+public:
+	int repeat;
+	std::vector<int> sizes;
+	int logLevel;
+	bool logColor;
+	std::string logPattern;
+};
+
+void Options::parse(int argc, char *argv[])
+{
+	try {
+
+		for( int i = 1; i < argc; i++ ) {
+			std::string arg = argv[i];
+			if( arg == "--repeat" ) {
+				repeat = boost::lexical_cast<int>(argv[++i]);
+			} else if( arg == "--size" ) {
+				// 1,2,3 の形式
+				sizes.clear();
+				std::stringstream ss(argv[++i]);
+				std::string s;
+				while( std::getline(ss, s, ',') ) {
+					sizes.push_back(boost::lexical_cast<int>(s));
+				}
+			} else if( arg == "--set-log-pattern" ) {
+				logPattern = argv[++i];
+			} else if( arg == "--enable-log-color" ) {
+				logColor = true;
+			} else if( arg == "--log-level" ) {
+				logLevel = boost::lexical_cast<int>(argv[++i]);
+			} else {
+				throw Error("unknown option specified");
+			}
+		}
+
+	} catch(...) {
+		throw Error("invalid option specified");
+	}
+
+	if( repeat < 1 || sizes.empty() ) {
+		throw Error("invalid option specified");
+	}
+}
+
+// 1 呼び出しあたりのナノ秒
+template <typename F>
+static double measure(int repeat, F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	for( int r = 0; r < repeat; r++ ) {
+		f();
+	}
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count()/repeat;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = 0x0;
+	Logger::setName("kbench");
+
+	try {
+
+		Options options;
+		options.parse(argc, argv);
+
+		Logger::setLevel(options.logLevel);
+
+		Logger::setColor(options.logColor);
+		if( !options.logPattern.empty() ) {
+			Logger::setPattern(options.logPattern);
+		} else {
+			Logger::setPattern("[%n][%l] %v");
+		}
+
+		Logger::info() << "kbench 0.0.1";
+		Logger::info() << "Copyright (C) 2016 PORT, Inc.";
+
+		// alpha は線形空間、wg は重みと素性の内積なので小さな値に収まる
+		std::mt19937 rng(0);
+		std::uniform_real_distribution<double> ua(0.0, 1.0);
+		std::uniform_real_distribution<double> uw(-4.0, 4.0);
+
+		auto isas = Kernel::supportedIsas();
+		for( auto n : options.sizes ) {
+			std::vector<double> a(n);
+			std::vector<double> w(n);
+			for( int k = 0; k < n; k++ ) {
+				a[k] = ua(rng);
+				w[k] = uw(rng);
+			}
+
+			// スカラー実装の和を基準とする
+			Kernel::select("scalar");
+			double base = Kernel::sumExp(a.data(), w.data(), n);
+
+			for( auto& isa : isas ) {
+				Kernel::select(isa);
+
+				volatile double sink = 0.0;
+				double sum = 0.0;
+				auto tSum = measure(options.repeat, [&]() {
+					sum = Kernel::sumExp(a.data(), w.data(), n);
+					sink = sink + sum;
+				});
+				int k = -1;
+				auto tMax = measure(options.repeat, [&]() {
+					sink = sink + Kernel::maxAdd(a.data(), w.data(), n, k);
+				});
+
+				// 実装による違いは足し合わせの順序だけなので相対誤差は丸め程度になる
+				Logger::out()->info( "n: {} isa: {} sumExp: {} ns maxAdd: {} ns argmax: {} error: {}", n, isa, tSum, tMax, k, std::abs(sum - base)/base );
+			}
+
+			// 項の数が L*M と一致する特殊化したカーネル
+			for( auto& cell : Kernel::fixedCells() ) {
+				if( cell.width() != n ) {
+					continue;
+				}
+
+				volatile double sink = 0.0;
+				double sum = 0.0;
+				auto tSum = measure(options.repeat, [&]() {
+					sum = cell.sumExp(a.data(), w.data(), n);
+					sink = sink + sum;
+				});
+				int k = -1;
+				auto tMax = measure(options.repeat, [&]() {
+					sink = sink + cell.maxAdd(a.data(), w.data(), n, k);
+				});
+
+				Logger::out()->info( "n: {} fixed: ({},{}) sumExp: {} ns maxAdd: {} ns argmax: {} error: {}", n, cell.labels, cell.maxLength, tSum, tMax, k, std::abs(sum - base)/base );
+			}
+		}
+
+	} catch(Error& e) {
+
+		Logger::out()->error("{}", e.what());
+		ret = 0x1;
+
+	} catch(std::exception& e) {
+
+		Logger::out()->error("{}", e.what());
+		ret = 0x2;
+
+	} catch(...) {
+
+		Logger::out()->error("unexpected exception");
+		ret = 0x3;
+	}
+
+	if( !ret ) {
+		Logger::info("OK");
+	}
+
+	exit(ret);
+}
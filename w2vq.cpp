@@ -0,0 +1,163 @@
+// © 2016 PORT INC.
+
+#include <iostream>
+#include <sstream>
+#include <cmath>
+#include <vector>
+#include <sys/stat.h>
+#include <boost/lexical_cast.hpp>
+#include "Logger.hpp"
+#include "Error.hpp"
+#include "W2V.hpp"
+
+class Options {
+public:
+	Options()
+		: input("")
+		, output("")
+		, type(W2V::INT8)
+		, logLevel(3)
+		, logColor(false)
+		, logPattern("")
+		{};
+	void parse(int argc, char *argv[]);
+public:
+	std::string input;
+	std::string output;
+	W2V::Type type;
+	int logLevel;
+	bool logColor;
+	std::string logPattern;
+};
+
+void Options::parse(int argc, char *argv[])
+{
+	if( argc < 3 ) {
+		throw Error("some argments missing");
+	}
+
+	try {
+
+		input  = argv[1];
+		output = argv[2];
+
+		for( int i = 3; i < argc; i++ ) {
+			std::string arg = argv[i];
+			if( arg == "--set-type" ) {
+				std::string t = argv[++i];
+				if( t == "int8" ) {
+					type = W2V::INT8;
+				} else if( t == "fp16" ) {
+					type = W2V::FLOAT16;
+				} else {
+					throw Error("unknown type specified");
+				}
+			} else if( arg == "--set-log-pattern" ) {
+				logPattern = argv[++i];
+			} else if( arg == "--enable-log-color" ) {
+				logColor = true;
+			} else if( arg == "--log-level" ) {
+				logLevel = boost::lexical_cast<int>(argv[++i]);
+			} else {
+				throw Error("unknown option specified");
+			}
+		}
+
+	} catch(...) {
+		throw Error("invalid option specified");
+	}
+}
+
+static long long fileSize(const std::string& file)
+{
+	struct stat st;
+	if( stat(file.c_str(), &st) != 0 ) {
+		return 0;
+	}
+	return st.st_size;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = 0x0;
+	Logger::setName("w2vq");
+
+	try {
+
+		Options options;
+		options.parse(argc, argv);
+
+		Logger::setLevel(options.logLevel);
+
+		Logger::setColor(options.logColor);
+		if( !options.logPattern.empty() ) {
+			Logger::setPattern(options.logPattern);
+		} else {
+			Logger::setPattern("[%n][%l] %v");
+		}
+
+		Logger::info() << "w2vq 0.0.1";
+		Logger::info() << "Copyright (C) 2016 PORT, Inc.";
+
+		W2V::Matrix src(new W2V::Matrix_());
+		src->read(options.input);
+		src->write(options.output, options.type);
+
+		W2V::Matrix dst(new W2V::Matrix_());
+		dst->read(options.output);
+
+		///////////////	再構成誤差
+
+		long long words = src->getNumWords();
+		long long size = src->getSize();
+		double sumErr = 0.0;
+		double maxErr = 0.0;
+		double sumCos = 0.0;
+		std::vector<double> x(size);
+		std::vector<double> y(size);
+		for( long long i = 0; i < words; i++ ) {
+			std::fill(x.begin(), x.end(), 0.0);
+			std::fill(y.begin(), y.end(), 0.0);
+			src->add(i, x.data());
+			dst->add(i, y.data());
+
+			double xx = W2V::dot(x.data(), x.data(), size);
+			double yy = W2V::dot(y.data(), y.data(), size);
+			double xy = dst->dot(i, x.data());
+			double d = std::max(0.0, xx - 2.0*xy + yy);
+			double err = ( 0.0 < xx ) ? std::sqrt(d/xx) : std::sqrt(d);
+			sumErr += err;
+			maxErr = std::max(maxErr, err);
+			sumCos += ( 0.0 < xx && 0.0 < yy ) ? xy/std::sqrt(xx*yy) : 1.0;
+		}
+
+		long long s0 = fileSize(options.input);
+		long long s1 = fileSize(options.output);
+		Logger::out()->info( "size: {} -> {} ({}%)", s0, s1, ( 0 < s0 ) ? 100.0*s1/s0 : 0.0 );
+		if( 0 < words ) {
+			Logger::out()->info( "relative error: mean {} max {}", sumErr/words, maxErr );
+			Logger::out()->info( "cosine similarity: mean {}", sumCos/words );
+		}
+
+	} catch(Error& e) {
+
+		Logger::out()->error("{}", e.what());
+		ret = 0x1;
+
+	} catch(std::exception& e) {
+
+		Logger::out()->error("{}", e.what());
+		ret = 0x2;
+
+	} catch(...) {
+
+		Logger::out()->error("unexpected exception");
+		ret = 0x3;
+	}
+
+	if( !ret ) {
+		Logger::info("OK");
+	}
+
+	exit(ret);
+}